@@ -0,0 +1,470 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Host client for one or more devices over USB Serial
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "client.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// =-------------------------------------------------------------= Helpers =--=
+static std::vector<std::string> tokenize(const std::string &command) {
+  std::vector<std::string> tokens;
+  size_t start = command.find_first_not_of(' ');
+  while (start != std::string::npos) {
+    size_t end = command.find(' ', start);
+    tokens.push_back(command.substr(start, end - start));
+    start = command.find_first_not_of(' ', end);
+  }
+  return tokens;
+}
+
+// Tokens rejoined with single spaces, the same command always compares equal
+static std::string normalize(const std::vector<std::string> &tokens) {
+  std::string joined;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (i > 0) joined += ' ';
+    joined += tokens[i];
+  }
+  return joined;
+}
+
+// Whether every display named after the command is an id rather than an alias
+static bool numericTargets(const std::vector<std::string> &tokens) {
+  for (size_t i = 1; i < tokens.size(); i++) {
+    if (tokens[i].find_first_not_of("0123456789") != std::string::npos) return false;
+  }
+  return true;
+}
+
+// The device state a command changes: its active set, one display's entry or,
+// for a replay, an alias that changes what names mean or a command naming a
+// display by alias, which may be any display, everything
+static std::string stateKey(const std::vector<std::string> &tokens) {
+  const std::string &name = tokens[0];
+  if (name == "replay" || name == "alias") return "all";
+  if ((name == "set" || name == "select" || name == "deselect" || name == "remove") &&
+      !numericTargets(tokens)) {
+    return "all";
+  }
+  if (name == "set" || name == "clear" || name == "select" || name == "deselect") {
+    return "selection";
+  }
+  if ((name == "add" || name == "remove") && tokens.size() > 1) return "screen " + tokens[1];
+  return "";
+}
+
+// FNV-1a, as the firmware checks frames with
+static uint32_t checksum(const std::string &data) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < data.size(); i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// Header and payload of one stream frame
+static std::string encodeFrame(uint8_t encoding, const std::string &payload) {
+  uint32_t hash = checksum(payload);
+  std::string frame;
+  frame += (char)CLIENT_STREAM_MAGIC;
+  frame += (char)encoding;
+  frame += (char)(payload.size() >> 8);
+  frame += (char)payload.size();
+  for (int shift = 24; shift >= 0; shift -= 8) frame += (char)(hash >> shift);
+  return frame + payload;
+}
+
+// Runs of up to 255 identical pixels as <count> <pixel bytes>
+static std::string encodeRuns(const std::vector<uint8_t> &pixels, int bytesPerPixel) {
+  std::string encoded;
+  size_t i = 0;
+  while (i + bytesPerPixel <= pixels.size()) {
+    size_t run = 1;
+    while (run < 255 && i + (run + 1) * bytesPerPixel <= pixels.size() &&
+        std::equal(pixels.begin() + i, pixels.begin() + i + bytesPerPixel,
+          pixels.begin() + i + run * bytesPerPixel)) {
+      run++;
+    }
+    encoded += (char)run;
+    encoded.append((const char *)&pixels[i], bytesPerPixel);
+    i += run * bytesPerPixel;
+  }
+  return encoded;
+}
+
+static long monotonicMsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// =---------------------------------------------------------------= Client =--=
+MonitorClient::MonitorClient() {
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+MonitorClient::~MonitorClient() {
+  for (size_t i = 0; i < devices.size(); i++) close(i, "client closed");
+  if (epollFd >= 0) ::close(epollFd);
+}
+
+int MonitorClient::discover(const char *pattern) {
+  glob_t found;
+  if (glob(pattern, 0, NULL, &found) != 0) return 0;
+
+  int opened = 0;
+  for (size_t i = 0; i < found.gl_pathc; i++) {
+    if (open(found.gl_pathv[i])) opened++;
+  }
+  globfree(&found);
+  return opened;
+}
+
+bool MonitorClient::open(const std::string &path) {
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (devices[i].path == path && devices[i].fd >= 0) return false;
+  }
+
+  int fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  // Raw bytes, no echo or line editing. The Photon ignores the baud rate on
+  // USB, it is set for serial adapters.
+  struct termios tty;
+  if (tcgetattr(fd, &tty) == 0) {
+    cfmakeraw(&tty);
+    cfsetspeed(&tty, B9600);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tty);
+  }
+
+  device added;
+  added.path = path;
+  added.fd = fd;
+  added.nextTag = 1;
+  devices.push_back(added);
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = devices.size() - 1;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    close(devices.size() - 1, "epoll failed");
+    return false;
+  }
+  return true;
+}
+
+size_t MonitorClient::deviceCount() const {
+  return devices.size();
+}
+
+const std::string &MonitorClient::devicePath(size_t device) const {
+  return devices[device].path;
+}
+
+int MonitorClient::send(const std::string &command, replyHandler handler) {
+  int queued = 0;
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (send(i, command, handler)) queued++;
+  }
+  return queued;
+}
+
+bool MonitorClient::send(size_t index, const std::string &command, replyHandler handler) {
+  pendingCommand pending = { command, handler, 0 };
+  device &target = devices[index];
+  if (target.fd < 0) {
+    reply(pending, target.path, false, false, "disconnected");
+    return false;
+  }
+
+  std::vector<std::string> tokens = tokenize(command);
+  if (tokens.empty()) return false;
+  if (skip(target, tokens)) {
+    reply(pending, target.path, true, true, "");
+    return false;
+  }
+
+  pending.command = normalize(tokens);
+  pending.tag = target.nextTag++;
+  forget(target, tokens);
+  return queue(index, "#" + std::to_string(pending.tag) + " " + pending.command + '\n', pending);
+}
+
+int MonitorClient::sendFrame(const std::vector<uint8_t> &pixels, int bytesPerPixel, bool rle,
+    replyHandler handler) {
+  std::string frame = rle
+    ? encodeFrame(CLIENT_STREAM_RLE, encodeRuns(pixels, bytesPerPixel))
+    : encodeFrame(CLIENT_STREAM_RAW, std::string(pixels.begin(), pixels.end()));
+  pendingCommand pending = { "frame", handler, 0 };
+
+  int queued = 0;
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (queue(i, frame, pending)) queued++;
+  }
+  return queued;
+}
+
+int MonitorClient::endStream(replyHandler handler) {
+  std::string frame = encodeFrame(CLIENT_STREAM_END, "");
+  pendingCommand pending = { "end stream", handler, 0 };
+
+  int queued = 0;
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (queue(i, frame, pending)) queued++;
+  }
+  return queued;
+}
+
+void MonitorClient::onLine(lineHandler handler) {
+  lines = handler;
+}
+
+int MonitorClient::poll(int timeoutMsec) {
+  struct epoll_event events[16];
+  int count = epoll_wait(epollFd, events, 16, timeoutMsec);
+  if (count < 0) return errno == EINTR ? 0 : -1;
+
+  int handled = 0;
+  for (int i = 0; i < count; i++) {
+    size_t index = events[i].data.u64;
+    if (index >= devices.size() || devices[index].fd < 0) continue;
+
+    if (events[i].events & EPOLLIN) handled += readLines(index);
+    if (devices[index].fd >= 0 && (events[i].events & EPOLLOUT)) flush(index);
+    if (devices[index].fd >= 0 && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+      close(index, "disconnected");
+    }
+  }
+  return handled;
+}
+
+bool MonitorClient::wait(int timeoutMsec) {
+  long deadline = monotonicMsec() + timeoutMsec;
+  while (!idle()) {
+    long left = deadline - monotonicMsec();
+    if (left <= 0 || poll(left) < 0) return false;
+  }
+  return true;
+}
+
+bool MonitorClient::idle() const {
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (!devices[i].output.empty() || !devices[i].pending.empty()) return false;
+  }
+  return true;
+}
+
+int MonitorClient::fd() const {
+  return epollFd;
+}
+
+// Write bytes to a device and wait for their reply
+bool MonitorClient::queue(size_t index, const std::string &bytes, const pendingCommand &pending) {
+  device &target = devices[index];
+  if (target.fd < 0) {
+    reply(pending, target.path, false, false, "disconnected");
+    return false;
+  }
+  target.output += bytes;
+  target.pending.push_back(pending);
+  return flush(index);
+}
+
+// A `set`, `clear` or `add` the device already has, or a `remove` of a
+// display it no longer has
+bool MonitorClient::skip(device &target, const std::vector<std::string> &tokens) {
+  const std::string &command = tokens[0];
+  if (command == "set" || command == "clear") {
+    return normalize(tokens) == target.selection;
+  }
+  if ((command == "add" || command == "remove") && tokens.size() > 1) {
+    std::map<std::string, std::string>::iterator screen = target.screens.find(tokens[1]);
+    if (screen == target.screens.end()) return false;
+    return command == "add" ? screen->second == normalize(tokens) : screen->second.empty();
+  }
+  return false;
+}
+
+// A command on its way may change the state, it is unknown until the reply
+void MonitorClient::forget(device &target, const std::vector<std::string> &tokens) {
+  std::string key = stateKey(tokens);
+  if (key == "all") {
+    target.selection.clear();
+    target.screens.clear();
+  } else if (!key.empty()) {
+    // Changing a display also changes what a `set` of it lights
+    target.selection.clear();
+    if (key != "selection") target.screens.erase(tokens[1]);
+  }
+}
+
+// Record the state an accepted command left the device in, unless a later
+// command still waiting for its reply changes the same state
+void MonitorClient::remember(device &target, const std::string &command) {
+  std::vector<std::string> tokens = tokenize(command);
+  std::string key = stateKey(tokens);
+  if (key.empty()) return;
+
+  for (size_t i = 0; i < target.pending.size(); i++) {
+    std::string later = stateKey(tokenize(target.pending[i].command));
+    if (later == key || later == "all" || (key == "selection" && !later.empty())) return;
+  }
+
+  const std::string &name = tokens[0];
+  if (name == "set" || name == "clear") {
+    target.selection = command;
+  } else if (name == "add" || (name == "remove" && numericTargets(tokens))) {
+    target.screens[tokens[1]] = name == "add" ? command : "";
+  }
+}
+
+// Ask for EPOLLOUT only while there is something left to write
+void MonitorClient::watch(size_t index) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN | (devices[index].output.empty() ? 0 : EPOLLOUT);
+  event.data.u64 = index;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, devices[index].fd, &event);
+}
+
+// Write what the device will take without blocking
+bool MonitorClient::flush(size_t index) {
+  device &target = devices[index];
+  while (!target.output.empty()) {
+    ssize_t written = write(target.fd, target.output.data(), target.output.size());
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      close(index, strerror(errno));
+      return false;
+    }
+    target.output.erase(0, written);
+  }
+  watch(index);
+  return true;
+}
+
+// Find the command a reply line answers and take it off the pending queue,
+// with `status` set to the OK or ERROR after any tag. A tagged reply answers
+// the command sent with that tag, commands before it never got a reply. An
+// untagged one answers the oldest stream frame. Anything else, like an
+// error the device reports at boot or the replies to a `replay`, was not
+// asked for and is false.
+bool MonitorClient::match(device &target, const std::string &line, pendingCommand &command,
+    std::string &status) {
+  unsigned long tag = 0;
+  status = line;
+  if (line[0] == '#') {
+    size_t space = line.find(' ');
+    if (space == std::string::npos) return false;
+    tag = strtoul(line.c_str() + 1, NULL, 10);
+    status = line.substr(space + 1);
+  }
+  if (status != "OK" && status.compare(0, 5, "ERROR") != 0) return false;
+
+  if (tag == 0) {
+    if (target.pending.empty() || target.pending.front().tag != 0) return false;
+    command = target.pending.front();
+    target.pending.pop_front();
+    return true;
+  }
+
+  std::deque<pendingCommand>::iterator found = target.pending.begin();
+  while (found != target.pending.end() && found->tag != tag) ++found;
+  if (found == target.pending.end()) return false;
+
+  while (target.pending.begin() != found) {
+    pendingCommand lost = target.pending.front();
+    target.pending.pop_front();
+    reply(lost, target.path, false, false, "no reply");
+  }
+  command = target.pending.front();
+  target.pending.pop_front();
+  return true;
+}
+
+// Read what has arrived, matching OK and ERROR lines to the commands still
+// waiting. Returns the number of lines handled.
+int MonitorClient::readLines(size_t index) {
+  device &target = devices[index];
+  int handled = 0;
+  char buffer[256];
+
+  for (;;) {
+    ssize_t count = read(target.fd, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (count <= 0) {
+      close(index, count == 0 ? "disconnected" : strerror(errno));
+      break;
+    }
+
+    for (ssize_t i = 0; i < count; i++) {
+      char c = buffer[i];
+      if (c == '\r') continue;
+      if (c != '\n') {
+        if (target.input.size() < CLIENT_LINE_MAX) target.input += c;
+        continue;
+      }
+
+      std::string line;
+      line.swap(target.input);
+      handled++;
+
+      pendingCommand command;
+      std::string status;
+      if (!line.empty() && match(target, line, command, status)) {
+        bool ok = status == "OK";
+        std::string message = !ok && status.size() > 7 ? status.substr(7) : "";
+        if (ok) remember(target, command.command);
+        reply(command, target.path, ok, false, message);
+      } else if (lines) {
+        lines(target.path, line);
+      }
+    }
+  }
+  return handled;
+}
+
+// Drop a device, every command still waiting on it fails
+void MonitorClient::close(size_t index, const char *reason) {
+  device &target = devices[index];
+  if (target.fd < 0) return;
+
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, target.fd, NULL);
+  ::close(target.fd);
+  target.fd = -1;
+  target.output.clear();
+  target.input.clear();
+  target.selection.clear();
+  target.screens.clear();
+
+  while (!target.pending.empty()) {
+    pendingCommand command = target.pending.front();
+    target.pending.pop_front();
+    reply(command, target.path, false, false, reason);
+  }
+}
+
+void MonitorClient::reply(const pendingCommand &command, const std::string &path,
+    bool ok, bool skipped, const std::string &message) {
+  if (!command.handler) return;
+  clientReply result = { path, command.command, ok, skipped, message };
+  command.handler(result);
+}
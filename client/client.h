@@ -0,0 +1,124 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Host client for one or more devices over USB Serial
+*
+* Keeps a serial connection open to every device and drives them all from one
+* epoll loop. Writes never block, replies are matched to commands as they
+* arrive, and commands that would not change a device's state are skipped.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#ifndef MONITOR_CLIENT_H
+#define MONITOR_CLIENT_H
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define CLIENT_DEVICE_PATTERN "/dev/ttyACM*" // Where Photons show up on Linux
+#define CLIENT_LINE_MAX 512                  // Longest reply line kept
+#define CLIENT_STREAM_MAGIC 0xA5             // First byte of a frame header, as STREAM_MAGIC
+#define CLIENT_STREAM_RAW 0x00               // Frame encodings, as the firmware's streamEncoding
+#define CLIENT_STREAM_RLE 0x01
+#define CLIENT_STREAM_END 0xFF
+
+
+// =----------------------------------------------------------------= Types =--=
+struct clientReply {
+  std::string device;  // Path of the device that replied
+  std::string command; // Command as sent
+  bool ok;             // OK, or ERROR / not sent
+  bool skipped;        // Not sent, the device already had this state
+  std::string message; // Text after `ERROR: `, or why it was not sent
+};
+
+// Called once per command with its reply
+typedef std::function<void(const clientReply &)> replyHandler;
+
+// Called for lines that are not a reply, e.g. the `SCREEN:` lines after a
+// `list` or errors the device reports at boot
+typedef std::function<void(const std::string &device, const std::string &line)> lineHandler;
+
+
+// =---------------------------------------------------------------= Client =--=
+class MonitorClient {
+  public:
+    MonitorClient();
+    ~MonitorClient();
+
+    // Open every device matching a glob pattern, returns how many opened
+    int discover(const char *pattern = CLIENT_DEVICE_PATTERN);
+    // Open one device, a serial port or the slave side of a pty
+    bool open(const std::string &path);
+    size_t deviceCount() const;
+    const std::string &devicePath(size_t device) const;
+
+    // Queue a command for every device or for one of them. Returns how many
+    // commands were queued; a skipped one still gets its reply handler called.
+    int send(const std::string &command, replyHandler handler = replyHandler());
+    bool send(size_t device, const std::string &command, replyHandler handler = replyHandler());
+
+    // Stream a frame of pixel bytes, in strip byte order, to every device
+    // after their `stream` commands are accepted. With `rle` runs of the same
+    // pixel are sent once. Replies come back like command replies.
+    int sendFrame(const std::vector<uint8_t> &pixels, int bytesPerPixel, bool rle,
+      replyHandler handler = replyHandler());
+    // Leave streaming, the devices show their indicators again
+    int endStream(replyHandler handler = replyHandler());
+
+    void onLine(lineHandler handler);
+
+    // Wait up to `timeoutMsec` for I/O and handle it, returns the number of
+    // replies handled or -1 on error
+    int poll(int timeoutMsec);
+    // Poll until every command has its reply, false on timeout
+    bool wait(int timeoutMsec);
+    // Nothing left to write and no reply outstanding
+    bool idle() const;
+
+    // The epoll descriptor, readable whenever poll() has work to do
+    int fd() const;
+
+  private:
+    struct pendingCommand {
+      std::string command;
+      replyHandler handler;
+      unsigned long tag; // Sent as `#<tag>` and echoed in the reply, 0 for a stream frame
+    };
+
+    struct device {
+      std::string path;
+      int fd;
+      std::string output;                 // Bytes not written yet
+      std::string input;                  // Partial line read so far
+      std::deque<pendingCommand> pending; // Sent, waiting for OK or ERROR
+      unsigned long nextTag;              // Tag for the next command
+      std::string selection;              // Last `set`/`clear` the device accepted
+      std::map<std::string, std::string> screens; // `add` line per display id
+    };
+
+    bool queue(size_t index, const std::string &bytes, const pendingCommand &pending);
+    bool match(device &target, const std::string &line, pendingCommand &command, std::string &status);
+    bool skip(device &target, const std::vector<std::string> &tokens);
+    void forget(device &target, const std::vector<std::string> &tokens);
+    void remember(device &target, const std::string &command);
+    void watch(size_t index);
+    bool flush(size_t index);
+    int readLines(size_t index);
+    void close(size_t index, const char *reason);
+    static void reply(const pendingCommand &command, const std::string &path,
+      bool ok, bool skipped, const std::string &message);
+
+    int epollFd;
+    std::vector<device> devices;
+    lineHandler lines;
+};
+
+#endif // MONITOR_CLIENT_H
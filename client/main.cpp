@@ -0,0 +1,224 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Command line client
+*
+* monitor-client [-d <device>]... [-t <msec>] [<command> ...]
+* monitor-client [-d <device>]... [-t <msec>] -b <frames> [-p <pixels>] [-r]
+*
+* Sends a command to every device and prints each reply, or with no command
+* reads commands from stdin, one per line, keeping the devices open between
+* them. Devices default to every CLIENT_DEVICE_PATTERN match.
+*
+* With -b it streams that many frames of a moving pattern to every device
+* instead and reports the frames per second reached, -r sends them RLE.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "client.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define CLIENT_TIMEOUT_MSEC 2000 // How long to wait for every reply
+#define CLIENT_LINGER_MSEC 100   // Quiet time that ends the lines after a reply
+#define CLIENT_PIXELS 10         // Pixels per frame by default, as PIXEL_COUNT
+#define CLIENT_BYTES_PER_PIXEL 3 // RGB strips; 4 for SK6812RGBW
+#define CLIENT_FRAMES_IN_FLIGHT 2 // Frames sent ahead of their replies, per device
+
+
+// =-------------------------------------------------------------= Helpers =--=
+static bool failed = false;
+
+static long monotonicMsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void printReply(const clientReply &reply) {
+  if (reply.skipped) {
+    printf("%s: OK (skipped)\n", reply.device.c_str());
+  } else if (reply.ok) {
+    printf("%s: OK\n", reply.device.c_str());
+  } else {
+    printf("%s: ERROR: %s\n", reply.device.c_str(), reply.message.c_str());
+    failed = true;
+  }
+  fflush(stdout);
+}
+
+static void printLine(const std::string &device, const std::string &line) {
+  printf("%s: %s\n", device.c_str(), line.c_str());
+  fflush(stdout);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: monitor-client [-d <device>]... [-t <msec>] [<command> ...]\n"
+    "       monitor-client [-d <device>]... [-t <msec>] -b <frames> [-p <pixels>] [-r]\n");
+  exit(2);
+}
+
+// A color wave moving one step a frame, in blocks of four pixels so RLE has
+// runs to pack
+static std::vector<uint8_t> patternFrame(int frame, int pixels) {
+  std::vector<uint8_t> bytes;
+  for (int i = 0; i < pixels; i++) {
+    int phase = (i / 4 * 16 + frame * 4) & 0xFF;
+    bytes.push_back(phase);
+    bytes.push_back(255 - phase);
+    bytes.push_back(phase / 2);
+  }
+  return bytes;
+}
+
+// Stream frames to every device as fast as they take them, keeping a few in
+// flight so the wire never waits on a reply
+static bool runBenchmark(MonitorClient &client, int timeout, int frames, int pixels, bool rle) {
+  client.send("stream", printReply);
+  if (!client.wait(timeout) || failed) return false;
+
+  long outstanding = 0;
+  int errors = 0;
+  replyHandler counted = [&](const clientReply &reply) {
+    outstanding--;
+    if (!reply.ok) {
+      if (errors++ < 10) printReply(reply);
+      failed = true;
+    }
+  };
+
+  long inFlight = client.deviceCount() * CLIENT_FRAMES_IN_FLIGHT;
+  size_t frameBytes = 0;
+  long start = monotonicMsec();
+  for (int frame = 0; frame < frames; frame++) {
+    while (outstanding >= inFlight) {
+      if (client.poll(timeout) <= 0) {
+        fprintf(stderr, "monitor-client: timed out\n");
+        return false;
+      }
+    }
+    std::vector<uint8_t> bytes = patternFrame(frame, pixels);
+    frameBytes += bytes.size();
+    outstanding += client.sendFrame(bytes, CLIENT_BYTES_PER_PIXEL, rle, counted);
+  }
+  if (!client.wait(timeout)) {
+    fprintf(stderr, "monitor-client: timed out\n");
+    return false;
+  }
+  long elapsed = monotonicMsec() - start;
+
+  client.endStream(printReply);
+  client.wait(timeout);
+
+  printf("%d frames of %d pixels%s in %ld ms: %.1f frames/sec, %.1f KB/s of pixels per device, %d errors\n",
+    frames, pixels, rle ? " (RLE)" : "", elapsed,
+    elapsed > 0 ? frames * 1000.0 / elapsed : 0.0,
+    elapsed > 0 ? frameBytes / 1.024 / elapsed : 0.0, errors);
+  return !failed;
+}
+
+// Send each line from stdin as it arrives, while handling device I/O
+static void runInteractive(MonitorClient &client, int timeout) {
+  std::string line;
+  bool open = true;
+
+  while (open || !client.idle()) {
+    struct pollfd fds[2] = {
+      { open ? STDIN_FILENO : -1, POLLIN, 0 },
+      { client.fd(), POLLIN, 0 }
+    };
+    if (::poll(fds, 2, open ? -1 : timeout) <= 0) break;
+
+    if (fds[1].revents & POLLIN) client.poll(0);
+    if (!(fds[0].revents & (POLLIN | POLLHUP))) continue;
+
+    char buffer[256];
+    ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (count <= 0) {
+      open = false;
+      continue;
+    }
+    for (ssize_t i = 0; i < count; i++) {
+      if (buffer[i] != '\n') {
+        line += buffer[i];
+        continue;
+      }
+      client.send(line, printReply);
+      line.clear();
+    }
+  }
+
+  while (client.poll(CLIENT_LINGER_MSEC) > 0) {}
+}
+
+
+// =-----------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  MonitorClient client;
+  int timeout = CLIENT_TIMEOUT_MSEC;
+  bool named = false;
+  int frames = 0;
+  int pixels = CLIENT_PIXELS;
+  bool rle = false;
+
+  int option;
+  while ((option = getopt(argc, argv, "d:t:b:p:r")) != -1) {
+    switch (option) {
+      case 'd':
+        named = true;
+        if (!client.open(optarg)) fprintf(stderr, "%s: cannot open\n", optarg);
+        break;
+      case 't':
+        timeout = atoi(optarg);
+        break;
+      case 'b':
+        frames = atoi(optarg);
+        break;
+      case 'p':
+        pixels = atoi(optarg);
+        break;
+      case 'r':
+        rle = true;
+        break;
+      default:
+        usage();
+    }
+  }
+
+  if (!named) client.discover();
+  if (client.deviceCount() == 0) {
+    fprintf(stderr, "monitor-client: no devices\n");
+    return 1;
+  }
+  client.onLine(printLine);
+
+  if (frames > 0) return runBenchmark(client, timeout, frames, pixels, rle) ? 0 : 1;
+
+  if (optind == argc) {
+    runInteractive(client, timeout);
+    return failed ? 1 : 0;
+  }
+
+  std::string command;
+  for (int i = optind; i < argc; i++) {
+    if (i > optind) command += ' ';
+    command += argv[i];
+  }
+
+  client.send(command, printReply);
+  if (!client.wait(timeout)) {
+    fprintf(stderr, "monitor-client: timed out\n");
+    return 1;
+  }
+  while (client.poll(CLIENT_LINGER_MSEC) > 0) {}
+
+  return failed ? 1 : 0;
+}
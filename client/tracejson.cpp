@@ -0,0 +1,154 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Trace dump to Chrome trace JSON
+*
+* trace-json [<file>]
+*
+* Reads the lines of a `trace` dump, from a file or stdin, and writes them as
+* a Chrome trace event file that chrome://tracing or Perfetto can open. Lines
+* may carry the `<device>: ` prefix monitor-client prints, each device becomes
+* its own process. Other lines are ignored.
+*
+* show() and EEPROM writes become slices ending at the event's time, since
+* their argument is how long they took. The other events become instants,
+* and the active indicators also a counter.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include <map>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define TRACE_PREFIX "TRACE: " // As traceLine() in main.cpp
+
+
+// =----------------------------------------------------------------= Types =--=
+// Event IDs, as traceEventId in main.cpp
+enum traceEventId {
+  TRACE_BYTE_RECEIVED = 1,
+  TRACE_COMMAND_PARSED,
+  TRACE_INDICATOR_CHANGED,
+  TRACE_FRAME_RENDERED,
+  TRACE_SHOW_COMPLETE,
+  TRACE_EEPROM_WRITTEN
+};
+
+struct traceDevice {
+  int pid;
+  uint32_t last;     // micros() of the previous event
+  uint64_t wraps;    // Time added for each micros() overflow so far
+};
+
+
+// =-------------------------------------------------------------= Globals =--=
+static std::map<std::string, traceDevice> devices;
+static bool firstEvent = true;
+
+
+// =---------------------------------------------------------------= Output =--=
+static void event(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void event(const char *format, ...) {
+  printf(firstEvent ? "\n  " : ",\n  ");
+  firstEvent = false;
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+static traceDevice &device(const std::string &name) {
+  auto found = devices.find(name);
+  if (found != devices.end()) return found->second;
+
+  traceDevice &added = devices[name];
+  added = { (int)devices.size(), 0, 0 };
+  event("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}",
+    added.pid, name.empty() ? "device" : name.c_str());
+  return added;
+}
+
+// Write one `TRACE: <usec> <event> <arg>` line, false when it is not one
+static bool convert(const std::string &name, const char *text) {
+  unsigned long time, id, arg;
+  if (sscanf(text, "%lu %lu %lu", &time, &id, &arg) != 3) return false;
+
+  // The dump is oldest first, so the clock going back is micros() wrapping
+  traceDevice &d = device(name);
+  if ((uint32_t)time < d.last) d.wraps += (uint64_t)1 << 32;
+  d.last = time;
+  unsigned long long ts = d.wraps + time;
+
+  switch (id) {
+    case TRACE_BYTE_RECEIVED:
+      event("{\"name\": \"byte received\", \"cat\": \"serial\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, "
+        "\"pid\": %d, \"tid\": 1, \"args\": {\"byte\": %lu}}", ts, d.pid, arg);
+      break;
+    case TRACE_COMMAND_PARSED:
+      event("{\"name\": \"command parsed\", \"cat\": \"serial\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, "
+        "\"pid\": %d, \"tid\": 1, \"args\": {\"parameters\": %lu}}", ts, d.pid, arg);
+      break;
+    case TRACE_INDICATOR_CHANGED:
+      event("{\"name\": \"indicator changed\", \"cat\": \"indicators\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, "
+        "\"pid\": %d, \"tid\": 2, \"args\": {\"active\": \"0x%04lx\"}}", ts, d.pid, arg);
+      event("{\"name\": \"active indicators\", \"ph\": \"C\", \"ts\": %llu, \"pid\": %d, "
+        "\"args\": {\"count\": %d}}", ts, d.pid, __builtin_popcountl(arg));
+      break;
+    case TRACE_FRAME_RENDERED:
+      event("{\"name\": \"frame rendered\", \"cat\": \"strip\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, "
+        "\"pid\": %d, \"tid\": 2, \"args\": {\"show\": %lu}}", ts, d.pid, arg);
+      break;
+    case TRACE_SHOW_COMPLETE:
+      event("{\"name\": \"show\", \"cat\": \"strip\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %lu, "
+        "\"pid\": %d, \"tid\": 2}", ts > arg ? ts - arg : 0, arg, d.pid);
+      break;
+    case TRACE_EEPROM_WRITTEN:
+      event("{\"name\": \"EEPROM write\", \"cat\": \"eeprom\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %lu, "
+        "\"pid\": %d, \"tid\": 3}", ts > arg ? ts - arg : 0, arg, d.pid);
+      break;
+    default:
+      event("{\"name\": \"event %lu\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, \"pid\": %d, \"tid\": 1, "
+        "\"args\": {\"arg\": %lu}}", id, ts, d.pid, arg);
+      break;
+  }
+  return true;
+}
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: trace-json [<file>]\n");
+    return 2;
+  }
+  FILE *input = argc == 2 ? fopen(argv[1], "r") : stdin;
+  if (!input) {
+    perror("trace-json");
+    return 1;
+  }
+
+  printf("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  char line[256];
+  int events = 0;
+  while (fgets(line, sizeof(line), input)) {
+    char *text = strstr(line, TRACE_PREFIX);
+    if (!text) continue;
+
+    // monitor-client prints `<device>: ` before every line
+    std::string name(line, text - line);
+    if (name.size() >= 2 && name.compare(name.size() - 2, 2, ": ") == 0) name.resize(name.size() - 2);
+    if (convert(name, text + strlen(TRACE_PREFIX))) events++;
+  }
+  printf("\n]}\n");
+
+  if (input != stdin) fclose(input);
+  if (events == 0) fprintf(stderr, "trace-json: no TRACE lines read\n");
+  return events ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Animation engine benchmark
+*
+* animation-bench [<frames>]
+*
+* Loads common animation programs into the host build of the firmware, built
+* for some PIXEL_COUNT, and steps each one frame at a time. Reports the host
+* time stepAnimation() takes per frame, and the wire time show() then needs
+* in Photon cycles, which bounds the frame rate on a device.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "strip.h"
+#include "neopixel.h"
+
+#include <time.h>
+
+#ifndef PIXEL_COUNT
+#define PIXEL_COUNT 10 // As main.cpp, the Makefile builds one per length
+#endif
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define BENCH_FRAMES 2000 // Frames stepped per program unless given
+
+
+// =----------------------------------------------------------------= Types =--=
+struct benchProgram {
+  const char *name;
+  const char *code; // As sent to `animation`, every one loops forever
+};
+
+static const benchProgram programs[] = {
+  { "chase", "010000ff0200000001060003ff0502030009010700" },         // A blue pixel moving along
+  { "pulse", "01ff00000300060004ff0804000807" },                     // The strip ramping red up and down
+  { "blend", "06000100ff000610082005000701" "0000ff0610082005000707" }, // Easing between green and blue
+  { "flash", "060001ff000003ff0500010000ff03ff050007" },             // Filling red then blue every frame
+};
+
+
+// =-------------------------------------------------------------= Globals =--=
+extern Adafruit_NeoPixel strip;
+extern bool animationActive;
+
+
+// =-----------------------------------------------------------= Prototypes =--=
+bool stepAnimation();
+
+
+// =---------------------------------------------------------------= Running =--=
+static uint64_t nowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Run loop() for some milliseconds of virtual time
+static void runFor(int msec) {
+  for (int i = 0; i < msec; i++) {
+    hostLoop();
+    hostAdvance(HOST_CPU_HZ / 1000);
+  }
+}
+
+// Send a command and give the firmware a few passes to run it
+static bool command(const char *line) {
+  Serial.output.clear();
+  while (*line) Serial.input.push_back(*line++);
+  Serial.input.push_back('\n');
+  runFor(10);
+  return Serial.output.compare(0, 2, "OK") == 0;
+}
+
+static bool runProgram(const benchProgram &program, int frames) {
+  char line[128];
+  snprintf(line, sizeof(line), "animation 0 %s", program.code);
+  if (!command(line) || !command("play 0")) {
+    printf("%-6s could not be played: %s", program.name, Serial.output.c_str());
+    return false;
+  }
+
+  uint64_t total = 0, longest = 0;
+  for (int i = 0; i < frames && animationActive; i++) {
+    uint64_t start = nowNs();
+    stepAnimation();
+    uint64_t elapsed = nowNs() - start;
+    total += elapsed;
+    if (elapsed > longest) longest = elapsed;
+  }
+
+  hostWire.clear();
+  strip.show();
+  uint32_t wireNs = cyclesToNs(hostWire.back().end - hostWire.back().start);
+
+  printf("%5d pixels  %-6s vm %7.0f ns/frame  max %7.0f ns  wire %8.1f us/frame\n",
+    PIXEL_COUNT, program.name, (double)total / frames, (double)longest, wireNs / 1000.0);
+  command("stop");
+  return true;
+}
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  int frames = argc > 1 ? atoi(argv[1]) : BENCH_FRAMES;
+  hostSetup();
+  runFor(1); // A blank EEPROM is reported at boot
+
+  int failed = 0;
+  for (const benchProgram &program : programs) {
+    if (!runProgram(program, frames)) failed++;
+  }
+  return failed ? 1 : 0;
+}
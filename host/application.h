@@ -0,0 +1,195 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Host stand-in for the Particle firmware headers
+*
+* Just enough of the Device OS API to build main.cpp and the NeoPixel library
+* on Linux. Time is virtual: it moves with the cycles the code is charged for
+* and with hostAdvance(). Serial is a pair of byte queues, EEPROM is memory
+* and the data pin records every edge show() makes, with its cycle. Hosts run
+* the firmware through hostSetup() and hostLoop(), so the heap counters see
+* only its allocations and not those of the host or of this stand-in.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#ifndef HOST_APPLICATION_H
+#define HOST_APPLICATION_H
+
+#include <deque>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define PLATFORM_ID 6           // Build the Photon paths of the NeoPixel library
+#define HOST_CPU_HZ 120000000   // Photon core clock, cycles per virtual second
+#define HOST_CALL_CYCLES 12     // Charged per micros() or millis() call
+#define HOST_PIN_CYCLES 16      // Charged per pinSet(), with the bit test beside it, as a Photon measures
+#define HOST_DWT_CYCLES 1       // Charged per DWT->CYCCNT read, so wait loops end on the cycle
+#define HOST_SERIAL_BUFFER 1024 // Bytes the host side takes before availableForWrite() is 0
+#define HOST_EEPROM_SIZE 2047   // Emulated EEPROM on the Photon
+
+#define D0 0
+#define D1 1
+#define D2 2
+#define D3 3
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+#define CHARGE_DWT_OVERHEAD(cycles) hostDwtOverhead(cycles) // Around the NeoPixel DWT wait loops
+#define HEAP_COUNTED() hostFirmwareHeap                       // Only the firmware's own allocations
+
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+#define ATOMIC_BLOCK() for (int _atomic = 1; _atomic; _atomic = 0)
+
+typedef uint8_t byte;
+
+
+// =----------------------------------------------------------------= Types =--=
+class String {
+ public:
+  String(const char *text = "") : text(text) {}
+  const char *c_str() const { return text.c_str(); }
+  unsigned int length() const { return text.length(); }
+
+ private:
+  std::string text;
+};
+
+class USBSerial {
+ public:
+  void begin(long) {}
+  int available() { return input.size(); }
+  int read();
+  int peek() { return input.empty() ? -1 : input.front(); }
+  size_t readBytes(char *buffer, size_t length);
+  int availableForWrite() { return writable; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t length);
+  size_t println(const char *text);
+  size_t printlnf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  void flush() {}
+
+  // Host side
+  std::deque<uint8_t> input; // Bytes sent to the device, not read yet
+  std::string output;        // Bytes the device wrote, for the host to take
+  long writable = HOST_SERIAL_BUFFER;
+};
+
+struct EEPROMClass {
+  uint8_t bytes[HOST_EEPROM_SIZE];
+  EEPROMClass() { memset(bytes, 0xFF, sizeof(bytes)); }
+  size_t length() { return sizeof(bytes); }
+  uint8_t read(int address) { return bytes[address]; }
+  void write(int address, uint8_t value) { bytes[address] = value; }
+  template <typename T> T &get(int address, T &t) { memcpy(&t, bytes + address, sizeof(T)); return t; }
+  template <typename T> const T &put(int address, const T &t) { memcpy(bytes + address, &t, sizeof(T)); return t; }
+};
+
+struct CloudClass {
+  bool function(const char *, int (*)(String)) { return true; }
+  bool variable(const char *, String (*)()) { return true; }
+  bool connected() { return false; }
+};
+
+struct SystemClass {
+  uint32_t freeMemory() { return 60000; }
+};
+
+// A write to BSRRL or BSRRH drives the data pin high or low, every pin is it
+struct hostPinRegister {
+  bool high;
+  hostPinRegister &operator=(uint16_t pins);
+};
+
+struct GPIO_TypeDef {
+  hostPinRegister BSRRL = { true };
+  hostPinRegister BSRRH = { false };
+};
+
+struct STM32_Pin_Info {
+  GPIO_TypeDef *gpio_peripheral;
+  uint16_t gpio_pin;
+};
+
+// Reading the cycle counter returns the cycle it was read on
+struct hostCycleCounter {
+  operator uint32_t();
+};
+
+struct DWT_Type {
+  hostCycleCounter CYCCNT;
+};
+
+// Level changes on the data pin during one show(), between __disable_irq()
+// and __enable_irq()
+struct pinEdge {
+  uint64_t cycle;
+  bool high;
+};
+
+struct wireFrame {
+  uint64_t start, end;        // Cycles at __disable_irq() and __enable_irq()
+  bool idleHigh;              // Pin level before the first edge
+  std::vector<pinEdge> edges;
+};
+
+
+// =--------------------------------------------------------------= Globals =--=
+extern USBSerial Serial;
+extern EEPROMClass EEPROM;
+extern CloudClass Particle;
+extern SystemClass System;
+extern DWT_Type *DWT;
+
+extern uint64_t hostCycles;             // Virtual clock
+extern std::vector<wireFrame> hostWire; // Every show() so far, the host clears it
+extern bool hostFirmwareHeap;           // Allocations made now are the firmware's
+
+
+// =-----------------------------------------------------------= Prototypes =--=
+// The firmware, as Device OS calls it
+void setup();
+void loop();
+void serialEvent();
+
+unsigned long millis();
+unsigned long micros();
+long map(long value, long fromStart, long fromEnd, long toStart, long toEnd);
+void hostAdvance(uint64_t cycles);
+void hostDelay(const char *instructions);
+void hostDwtOverhead(uint32_t cycles);
+void pinMode(uint16_t pin, uint8_t mode);
+void digitalWrite(uint16_t pin, uint8_t value);
+STM32_Pin_Info *HAL_Pin_Map();
+void __disable_irq();
+void __enable_irq();
+
+
+// =-------------------------------------------------------------= Firmware =--=
+// Run the firmware from the host, counting only its own allocations. Inline,
+// so hosts without the firmware linked in never reference it.
+inline void hostSetup() {
+  hostFirmwareHeap = true;
+  setup();
+  hostFirmwareHeap = false;
+}
+
+// One pass of the application thread
+inline void hostLoop() {
+  hostFirmwareHeap = true;
+  loop();
+  if (Serial.available()) serialEvent();
+  hostFirmwareHeap = false;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Firmware simulator on a pseudo-terminal
+*
+* monitor-daemon [-r <bytes/sec>] [-l <link>]
+*
+* Runs the host build of the firmware in real time with its Serial on a new
+* pseudo-terminal, so real clients can connect to it like to a device. Prints
+* the terminal's path, and with -l also links it at <link>. -r throttles each
+* direction to that many bytes per second, as a USB CDC port would, leaving
+* the rest waiting in the pty. Runs until interrupted, then prints how many
+* bytes went each way.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "application.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define DAEMON_POLL_MSEC 1     // Longest sleep between loop() calls
+#define DAEMON_BURST_MSEC 10   // Throttled bytes that may build up while idle
+#define DAEMON_BURST_MIN 64    // ...but at least one USB packet
+
+#define CYCLES_PER_USEC (HOST_CPU_HZ / 1000000)
+
+
+// =----------------------------------------------------------------= Types =--=
+// Bytes one direction may move now, refilled at the throttled rate
+struct byteBucket {
+  double tokens;
+  double capacity;
+};
+
+
+// =-------------------------------------------------------------= Globals =--=
+static volatile sig_atomic_t stopping = 0;
+static unsigned long rate = 0; // Bytes per second each way, 0 for no limit
+static std::string pending;    // Written by the firmware, not yet taken by the pty
+static unsigned long long bytesIn = 0, bytesOut = 0;
+
+
+// =------------------------------------------------------------= Terminal =--=
+// Open a pty whose other end behaves like a raw serial port. Keeping the
+// slave open too means reads do not fail while no client is connected.
+static int openTerminal(int &slave, char *path, size_t length) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) return -1;
+  if (ptsname_r(master, path, length) != 0) return -1;
+
+  slave = open(path, O_RDWR | O_NOCTTY);
+  if (slave < 0) return -1;
+  struct termios tty;
+  tcgetattr(slave, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(slave, TCSANOW, &tty);
+
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  return master;
+}
+
+static uint64_t nowUsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void refill(byteBucket &bucket, uint64_t elapsedUsec) {
+  bucket.tokens += (double)rate * elapsedUsec / 1000000;
+  if (bucket.tokens > bucket.capacity) bucket.tokens = bucket.capacity;
+}
+
+// Host to device: what the pty has, as far as the throttle allows
+static void receive(int master, byteBucket &bucket) {
+  uint8_t buffer[256];
+  size_t room = sizeof(buffer);
+  if (rate && bucket.tokens < room) room = bucket.tokens;
+  if (room == 0) return;
+
+  ssize_t count = read(master, buffer, room);
+  if (count <= 0) return;
+  Serial.input.insert(Serial.input.end(), buffer, buffer + count);
+  bucket.tokens -= count;
+  bytesIn += count;
+}
+
+// Device to host: Serial.availableForWrite() follows the throttle and how
+// much the pty still has to take
+static void transmit(int master, byteBucket &bucket) {
+  bucket.tokens -= Serial.output.size();
+  pending += Serial.output;
+  Serial.output.clear();
+
+  if (!pending.empty()) {
+    ssize_t count = write(master, pending.data(), pending.size());
+    if (count > 0) {
+      pending.erase(0, count);
+      bytesOut += count;
+    }
+  }
+
+  long room = HOST_SERIAL_BUFFER - (long)pending.size();
+  if (rate && bucket.tokens < room) room = bucket.tokens;
+  Serial.writable = room > 0 ? room : 0;
+}
+
+static void stop(int) {
+  stopping = 1;
+}
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  const char *link = NULL;
+  int option;
+  while ((option = getopt(argc, argv, "r:l:")) != -1) {
+    switch (option) {
+      case 'r': rate = strtoul(optarg, NULL, 10); break;
+      case 'l': link = optarg; break;
+      default:
+        fprintf(stderr, "usage: monitor-daemon [-r <bytes/sec>] [-l <link>]\n");
+        return 2;
+    }
+  }
+
+  int slave;
+  char path[64];
+  int master = openTerminal(slave, path, sizeof(path));
+  if (master < 0) {
+    perror("monitor-daemon: pty");
+    return 1;
+  }
+  if (link) {
+    unlink(link);
+    if (symlink(path, link) < 0) perror("monitor-daemon: link");
+  }
+  printf("%s\n", path);
+  fflush(stdout);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  double capacity = rate * DAEMON_BURST_MSEC / 1000.0;
+  byteBucket in = { 0, capacity > DAEMON_BURST_MIN ? capacity : DAEMON_BURST_MIN };
+  byteBucket out = in;
+
+  // The virtual clock follows the wall clock, plus what the firmware spends
+  uint64_t start = nowUsec(), last = start;
+  hostSetup();
+  while (!stopping) {
+    uint64_t now = nowUsec();
+    uint64_t cycles = (now - start) * CYCLES_PER_USEC;
+    if (hostCycles < cycles) hostCycles = cycles;
+    refill(in, now - last);
+    refill(out, now - last);
+    last = now;
+
+    receive(master, in);
+    hostLoop();
+    transmit(master, out);
+    hostWire.clear();
+
+    struct pollfd ready = { master, POLLIN, 0 };
+    if (Serial.input.empty()) poll(&ready, 1, DAEMON_POLL_MSEC);
+  }
+
+  if (link) unlink(link);
+  close(slave);
+  close(master);
+  printf("%llu bytes in, %llu bytes out\n", bytesIn, bytesOut);
+  return 0;
+}
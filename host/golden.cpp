@@ -0,0 +1,165 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Golden frames for every fade curve
+*
+* fade-golden [-w] [<directory>]
+*
+* Fades one display in and back out on the host build of the firmware with
+* each fade curve, so every frame goes through planFade() and scaleColor(),
+* and decodes every frame show() puts on the wire. Compares the bytes of each
+* frame against the goldens checked in under <directory>, host/goldens unless
+* given, one `<curve>.txt` per curve, and exits non-zero on any difference.
+* With -w it writes the goldens instead, for a change that means to alter
+* the frames.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "strip.h"
+#include "neopixel.h"
+
+#include <unistd.h>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define GOLDEN_PIXEL_TYPE WS2812B // As PIXEL_TYPE in main.cpp
+#define GOLDEN_LOOP_USEC 100      // System thread time between loop() calls
+#define GOLDEN_FADE_MSEC 1000     // Run after each command, long enough for its fade to finish
+#define GOLDEN_PROFILE "40 255 400" // Color, brightness and fade of the display
+
+
+// =-------------------------------------------------------------= Globals =--=
+static const char *curves[] = {
+  "linear", "ease", "exp", "linear+gamma", "ease+gamma", "exp+gamma"
+};
+
+static std::vector<std::string> frames; // Hex bytes of each frame shown
+static std::string replies;
+
+
+// =-------------------------------------------------------------= Running =--=
+static void runFor(int msec) {
+  for (uint64_t until = hostCycles + (uint64_t)msec * (HOST_CPU_HZ / 1000); hostCycles < until; ) {
+    hostLoop();
+    for (const wireFrame &wire : hostWire) {
+      decodedFrame decoded;
+      if (!decodeFrame(wire, GOLDEN_PIXEL_TYPE, decoded)) {
+        fprintf(stderr, "frame %u: %s\n", (unsigned int)frames.size(), decoded.error);
+        exit(1);
+      }
+      std::string hex;
+      for (uint8_t byte : decoded.bytes) {
+        char digits[3];
+        snprintf(digits, sizeof(digits), "%02x", byte);
+        hex += digits;
+      }
+      frames.push_back(hex);
+    }
+    hostWire.clear();
+
+    replies += Serial.output;
+    Serial.output.clear();
+    hostAdvance(GOLDEN_LOOP_USEC * (HOST_CPU_HZ / 1000000));
+  }
+}
+
+static void command(const std::string &line) {
+  for (char c : line) Serial.input.push_back(c);
+  Serial.input.push_back('\n');
+  runFor(GOLDEN_FADE_MSEC);
+}
+
+// The frames of one display lit and then cleared with a curve, in the
+// golden file format
+static std::string renderFades(const char *curve) {
+  frames.clear();
+  replies.clear();
+  command(std::string("add 1 0 " GOLDEN_PROFILE " ") + curve);
+  frames.clear(); // Only the fades
+  command("set 1");
+  command("clear");
+
+  std::string text = std::string("# add 1 0 " GOLDEN_PROFILE " ") + curve + ", set 1, clear\n";
+  for (const std::string &frame : frames) text += frame + "\n";
+  return text;
+}
+
+
+// =-----------------------------------------------------------= Comparing =--=
+static bool readFile(const std::string &path, std::string &text) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) return false;
+  char buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, length);
+  fclose(file);
+  return true;
+}
+
+// The first line that differs, 0 when none does
+static int firstDifference(const std::string &expected, const std::string &actual) {
+  int line = 1;
+  size_t i = 0;
+  for (; i < expected.size() && i < actual.size() && expected[i] == actual[i]; i++) {
+    if (expected[i] == '\n') line++;
+  }
+  return i == expected.size() && i == actual.size() ? 0 : line;
+}
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  bool write = false;
+  int option;
+  while ((option = getopt(argc, argv, "w")) != -1) {
+    if (option != 'w') return 2;
+    write = true;
+  }
+  if (optind + 1 < argc) {
+    fprintf(stderr, "usage: fade-golden [-w] [<directory>]\n");
+    return 2;
+  }
+  std::string directory = optind < argc ? argv[optind] : "host/goldens";
+
+  hostSetup();
+  runFor(1); // A blank EEPROM is reported at boot
+
+  int failed = 0;
+  for (const char *curve : curves) {
+    std::string actual = renderFades(curve);
+    std::string path = directory + "/" + curve + ".txt";
+    int frameCount = (int)frames.size();
+    if (replies.find("ERROR") != std::string::npos) {
+      printf("%-12s %s", curve, replies.substr(replies.find("ERROR")).c_str());
+      failed++;
+      continue;
+    }
+
+    if (write) {
+      FILE *file = fopen(path.c_str(), "w");
+      if (!file || fputs(actual.c_str(), file) < 0) {
+        perror(path.c_str());
+        return 1;
+      }
+      fclose(file);
+      printf("%-12s %3d frames  written to %s\n", curve, frameCount, path.c_str());
+      continue;
+    }
+
+    std::string expected;
+    if (!readFile(path, expected)) {
+      printf("%-12s %3d frames  no golden at %s\n", curve, frameCount, path.c_str());
+      failed++;
+      continue;
+    }
+    int line = firstDifference(expected, actual);
+    if (line) {
+      printf("%-12s %3d frames  differs from %s at line %d\n", curve, frameCount, path.c_str(), line);
+      failed++;
+    } else {
+      printf("%-12s %3d frames  ok\n", curve, frameCount);
+    }
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Host stand-in for the Particle firmware
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "application.h"
+
+
+// =----------------------------------------------------------------= Types =--=
+// Stand-in bookkeeping while the firmware runs, left out of its heap counts
+struct halScope {
+  bool counted = hostFirmwareHeap;
+  halScope() { hostFirmwareHeap = false; }
+  ~halScope() { hostFirmwareHeap = counted; }
+};
+
+
+// =--------------------------------------------------------------= Globals =--=
+USBSerial Serial;
+EEPROMClass EEPROM;
+CloudClass Particle;
+SystemClass System;
+
+uint64_t hostCycles = 0;
+std::vector<wireFrame> hostWire;
+bool hostFirmwareHeap = false;
+
+static DWT_Type dwt;
+DWT_Type *DWT = &dwt;
+
+static GPIO_TypeDef gpio;            // Every pin is on one port
+static STM32_Pin_Info pinMap[32];
+static bool pinLevel = false;        // Data pin level, all pins share it
+static bool interruptsOff = false;
+static bool dwtTimed = false;        // The frame is timed by the cycle counter
+
+
+// =-----------------------------------------------------------------= Time =--=
+unsigned long micros() {
+  hostCycles += HOST_CALL_CYCLES;
+  return hostCycles / (HOST_CPU_HZ / 1000000);
+}
+
+unsigned long millis() {
+  hostCycles += HOST_CALL_CYCLES;
+  return hostCycles / (HOST_CPU_HZ / 1000);
+}
+
+void hostAdvance(uint64_t cycles) {
+  hostCycles += cycles;
+}
+
+// Stands in for an `asm volatile` delay in show(), one cycle per instruction
+void hostDelay(const char *instructions) {
+  for (const char *c = instructions; *c; c++) {
+    if (*c == '\n') hostCycles++;
+  }
+}
+
+hostCycleCounter::operator uint32_t() {
+  if (interruptsOff) dwtTimed = true;
+  uint32_t now = hostCycles;
+  hostCycles += HOST_DWT_CYCLES;
+  return now;
+}
+
+// The cycles a DWT timed phase spends outside its wait loop, as measured on a
+// Photon, and its pin writes with them. A low phase already holds two counter
+// reads here, the one ending its wait and the one starting the next bit.
+void hostDwtOverhead(uint32_t cycles) {
+  hostCycles += pinLevel ? cycles : cycles - 2 * HOST_DWT_CYCLES;
+}
+
+
+// =-----------------------------------------------------------------= Pins =--=
+static void drivePin(bool high) {
+  halScope scope;
+  if (high == pinLevel) return;
+  pinLevel = high;
+  if (interruptsOff) hostWire.back().edges.push_back({ hostCycles, high });
+}
+
+hostPinRegister &hostPinRegister::operator=(uint16_t) {
+  if (!dwtTimed) hostCycles += HOST_PIN_CYCLES;
+  drivePin(high);
+  return *this;
+}
+
+void pinMode(uint16_t, uint8_t) {}
+
+void digitalWrite(uint16_t, uint8_t value) {
+  drivePin(value == HIGH);
+}
+
+STM32_Pin_Info *HAL_Pin_Map() {
+  for (int i = 0; i < 32; i++) pinMap[i] = { &gpio, (uint16_t)(1 << (i % 16)) };
+  return pinMap;
+}
+
+// show() runs its bitstream with interrupts off, so each such stretch is a frame
+void __disable_irq() {
+  halScope scope;
+  interruptsOff = true;
+  dwtTimed = false;
+  hostWire.push_back({ hostCycles, hostCycles, pinLevel, {} });
+}
+
+void __enable_irq() {
+  interruptsOff = false;
+  hostWire.back().end = hostCycles;
+}
+
+
+// =---------------------------------------------------------------= Serial =--=
+int USBSerial::read() {
+  halScope scope;
+  if (input.empty()) return -1;
+  uint8_t c = input.front();
+  input.pop_front();
+  return c;
+}
+
+size_t USBSerial::readBytes(char *buffer, size_t length) {
+  size_t count = 0;
+  while (count < length && !input.empty()) buffer[count++] = read();
+  return count;
+}
+
+size_t USBSerial::write(const uint8_t *buffer, size_t length) {
+  halScope scope;
+  if ((long)length > writable) length = writable;
+  output.append((const char *)buffer, length);
+  writable -= length;
+  return length;
+}
+
+// Builds from before the reply queue write lines straight to Serial
+size_t USBSerial::println(const char *text) {
+  size_t length = write((const uint8_t *)text, strlen(text));
+  return length + write((const uint8_t *)"\r\n", 2);
+}
+
+size_t USBSerial::printlnf(const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  return println(line);
+}
+
+
+// =----------------------------------------------------------------= Math =--=
+// Wiring's map(), which builds from before the fade curves scale with
+long map(long value, long fromStart, long fromEnd, long toStart, long toEnd) {
+  return (value - fromStart) * (toEnd - toStart) / (fromEnd - fromStart) + toStart;
+}
@@ -0,0 +1,328 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Command to photon latency benchmark
+*
+* latency-bench [-m <usec>] <stream>
+* latency-bench -f <stream>
+*
+* Plays a recorded command stream into the host build of the firmware at its
+* original timing and decodes every frame show() puts on the wire. The stream
+* is in the `capture` format, `[CAPTURE: ]<msec> <command>` a line with the
+* time since the previous command.
+*
+* For each command that changes the active set it measures, from the command
+* reaching Serial, the time until the first frame on the wire that differs
+* from the one before the command, and until the first frame at the state the
+* strip settles on before the next command. A command followed by another
+* before the strip settled only counts toward the first. Reports p50/p99/max
+* over the stream, then the firmware's own `latency` for comparison. Exits
+* non-zero on any ERROR reply, or with -m when the p99 to the first changed
+* frame is over that many microseconds. Also reports the allocations the
+* firmware made per command type, and fails when a selection command made any,
+* and the selections the firmware received against the active sets it applied.
+* Built with -DSELECTION_MAILBOX=0 it runs the firmware with every selection
+* applied as it arrives, for comparison.
+*
+* With -f it replays the stream back to back instead, as `replay fast` does
+* but from a file of any length, and reports the throughput on the virtual
+* clock and the host time the firmware took per command, its allocations,
+* the frames shown and an FNV-1a checksum over their bytes on the wire.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "strip.h"
+#include "neopixel.h"
+
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define BENCH_PIXEL_TYPE WS2812B // As PIXEL_TYPE in main.cpp
+#define BENCH_LOOP_USEC 100      // System thread time between loop() calls
+#define BENCH_SETTLE_MSEC 100    // Unchanged before the next command for the strip to count as settled
+#define BENCH_TAIL_MSEC 2000     // Run after the last command, for its fade to finish
+#define BENCH_COMMAND_TYPES 8    // As COMMAND_TYPES in main.cpp, selections first
+#define BENCH_SELECTION_TYPES 4  // set, select, deselect and clear, which must not allocate
+
+#ifndef SELECTION_MAILBOX
+#define SELECTION_MAILBOX 1       // As in main.cpp, both are built with the same flags
+#endif
+
+#define CYCLES_PER_USEC (HOST_CPU_HZ / 1000000)
+
+
+// =----------------------------------------------------------------= Types =--=
+struct streamCommand {
+  uint64_t time;      // Cycle the line reaches Serial
+  std::string line;
+  bool selection;     // set, select, deselect or clear
+};
+
+struct shownFrame {
+  uint64_t end;       // Cycle the last bit left the pin
+  std::vector<uint8_t> bytes;
+};
+
+
+// =-------------------------------------------------------------= Globals =--=
+static std::vector<shownFrame> frames;
+static int replyErrors = 0;
+static std::string replies;
+static uint64_t firmwareNs = 0; // Host time spent running the firmware
+
+// The firmware's per command type counters
+extern const char *commandNames[BENCH_COMMAND_TYPES];
+extern uint32_t commandLines[BENCH_COMMAND_TYPES];
+extern uint32_t commandAllocs[BENCH_COMMAND_TYPES];
+extern uint32_t heapAllocs;
+extern uint32_t selections;
+extern uint32_t selectionsApplied;
+
+
+// =------------------------------------------------------------= Playback =--=
+static bool readStream(const char *path, std::vector<streamCommand> &commands) {
+  FILE *file = fopen(path, "r");
+  if (!file) return false;
+
+  char line[256];
+  uint64_t time = 0;
+  while (fgets(line, sizeof(line), file)) {
+    char *text = line;
+    if (strncmp(text, "CAPTURE: ", 9) == 0) text += 9;
+    char *command;
+    unsigned long msec = strtoul(text, &command, 10);
+    if (command == text) continue;
+    while (*command == ' ') command++;
+    command[strcspn(command, "\r\n")] = 0;
+    if (*command == 0) continue;
+
+    time += (uint64_t)msec * 1000 * CYCLES_PER_USEC;
+    std::string name(command, strcspn(command, " "));
+    bool selection = name == "set" || name == "select" || name == "deselect" || name == "clear";
+    commands.push_back({ time, command, selection });
+  }
+  fclose(file);
+  return true;
+}
+
+// Run the firmware until the virtual clock reaches `until`, decoding every
+// frame and reading every reply as a host would
+static uint64_t nowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void runUntil(uint64_t until) {
+  while (hostCycles < until) {
+    uint64_t start = nowNs();
+    hostLoop();
+    firmwareNs += nowNs() - start;
+
+    for (const wireFrame &wire : hostWire) {
+      decodedFrame decoded;
+      if (!decodeFrame(wire, BENCH_PIXEL_TYPE, decoded)) {
+        fprintf(stderr, "frame at %llu us: %s\n", (unsigned long long)(wire.end / CYCLES_PER_USEC), decoded.error);
+        exit(1);
+      }
+      frames.push_back({ wire.end, decoded.bytes });
+    }
+    hostWire.clear();
+
+    replies += Serial.output;
+    Serial.output.clear();
+    Serial.writable = HOST_SERIAL_BUFFER;
+    hostAdvance(BENCH_LOOP_USEC * CYCLES_PER_USEC);
+  }
+}
+
+static void sendLine(const std::string &line) {
+  for (char c : line) Serial.input.push_back(c);
+  Serial.input.push_back('\n');
+}
+
+
+// Replies to commands so far, every command gets one OK or ERROR line
+static size_t replyCount() {
+  size_t count = 0;
+  for (size_t at = 0; at < replies.size(); ) {
+    if (replies.compare(at, 2, "OK") == 0 || replies.compare(at, 5, "ERROR") == 0) count++;
+    size_t end = replies.find('\n', at);
+    if (end == std::string::npos) break;
+    at = end + 1;
+  }
+  return count;
+}
+
+// Send every command at once and run until each has its reply and the
+// strip has settled
+static void replayFast(const std::vector<streamCommand> &commands) {
+  uint64_t start = hostCycles;
+  uint64_t startNs = firmwareNs;
+  uint32_t startAllocs = heapAllocs;
+  size_t startFrames = frames.size();
+
+  for (const streamCommand &command : commands) sendLine(command.line);
+  while (replyCount() < commands.size()) runUntil(hostCycles + 1);
+  uint64_t elapsed = (hostCycles - start) / CYCLES_PER_USEC;
+  uint64_t hostNs = firmwareNs - startNs;
+  runUntil(hostCycles + (uint64_t)BENCH_TAIL_MSEC * 1000 * CYCLES_PER_USEC);
+
+  uint32_t hash = 2166136261UL;
+  for (size_t i = startFrames; i < frames.size(); i++) {
+    for (uint8_t byte : frames[i].bytes) hash = (hash ^ byte) * 16777619UL;
+  }
+  printf("replay %u commands in %llu us  %llu commands/sec  host %.2f us/command  allocs %lu  frames %u  checksum %08lx\n",
+    (unsigned int)commands.size(), (unsigned long long)elapsed,
+    elapsed ? (unsigned long long)commands.size() * 1000000 / elapsed : 0,
+    hostNs / 1000.0 / commands.size(), (unsigned long)(heapAllocs - startAllocs),
+    (unsigned int)(frames.size() - startFrames), (unsigned long)hash);
+}
+
+
+// =-----------------------------------------------------------= Reporting =--=
+// Nearest rank, as the firmware's latencyPercentile()
+static uint32_t percentile(std::vector<uint32_t> samples, unsigned int percent) {
+  if (samples.empty()) return 0;
+  std::sort(samples.begin(), samples.end());
+  return samples[(samples.size() * percent + 99) / 100 - 1];
+}
+
+static void report(const char *name, const std::vector<uint32_t> &samples) {
+  uint64_t sum = 0;
+  for (uint32_t sample : samples) sum += sample;
+  printf("%-6s %3u samples  p50 %6lu us  p99 %6lu us  max %6lu us  mean %6lu us\n", name,
+    (unsigned int)samples.size(), (unsigned long)percentile(samples, 50), (unsigned long)percentile(samples, 99),
+    (unsigned long)percentile(samples, 100), samples.empty() ? 0 : (unsigned long)(sum / samples.size()));
+}
+
+// Allocations per command type over the stream, from the firmware's own
+// counters, which see none of the host's. Returns the selection types that
+// allocated.
+static int reportAllocs() {
+  int allocatingSelections = 0;
+  for (int i = 0; i < BENCH_COMMAND_TYPES; i++) {
+    if (commandLines[i] == 0) continue;
+    printf("allocs %-8s %4lu commands %6lu allocs %6.1f per command\n", commandNames[i],
+      (unsigned long)commandLines[i], (unsigned long)commandAllocs[i], (double)commandAllocs[i] / commandLines[i]);
+    if (i < BENCH_SELECTION_TYPES && commandAllocs[i]) allocatingSelections++;
+  }
+  return allocatingSelections;
+}
+
+// Index of the first frame ending at or after `time`
+static size_t frameAfter(uint64_t time) {
+  size_t i = 0;
+  while (i < frames.size() && frames[i].end < time) i++;
+  return i;
+}
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  unsigned long budget = 0;
+  bool fast = false;
+  int option;
+  while ((option = getopt(argc, argv, "m:f")) != -1) {
+    if (option == 'm') budget = strtoul(optarg, NULL, 10);
+    else if (option == 'f') fast = true;
+    else return 2;
+  }
+
+  std::vector<streamCommand> commands;
+  if (optind + 1 != argc || !readStream(argv[optind], commands)) {
+    fprintf(stderr, "usage: latency-bench [-m <usec>] <stream>\n       latency-bench -f <stream>\n");
+    return 2;
+  }
+  const char *path = argv[optind];
+
+  hostSetup();
+  runUntil(hostCycles + 1);
+  replies.clear(); // A blank EEPROM is reported at boot
+
+  if (fast) {
+    replayFast(commands);
+    for (size_t at = replies.find("ERROR"); at != std::string::npos; at = replies.find("ERROR", at + 1)) {
+      replyErrors++;
+    }
+    printf("%s: %d errors\n", path, replyErrors);
+    if (reportAllocs()) {
+      printf("selection commands allocate\n");
+      return 1;
+    }
+    return replyErrors ? 1 : 0;
+  }
+
+  uint64_t start = hostCycles;
+  for (streamCommand &command : commands) {
+    command.time += start;
+    runUntil(command.time);
+    sendLine(command.line);
+  }
+  runUntil(hostCycles + (uint64_t)BENCH_TAIL_MSEC * 1000 * CYCLES_PER_USEC);
+
+  std::vector<uint32_t> firstFrame, settled;
+  int selections = 0;
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (!commands[i].selection) continue;
+    selections++;
+
+    uint64_t sent = commands[i].time;
+    uint64_t next = i + 1 < commands.size() ? commands[i + 1].time : hostCycles;
+    size_t first = frameAfter(sent);
+    size_t last = frameAfter(next);
+    if (first == 0 || first >= last) continue;
+    const std::vector<uint8_t> &before = frames[first - 1].bytes;
+
+    size_t changed = first;
+    while (changed < last && frames[changed].bytes == before) changed++;
+    if (changed == last) continue;
+    firstFrame.push_back((frames[changed].end - sent) / CYCLES_PER_USEC);
+
+    // Settled when nothing new was shown for a while before the next command
+    const std::vector<uint8_t> &target = frames[last - 1].bytes;
+    uint64_t quiet = (uint64_t)BENCH_SETTLE_MSEC * 1000 * CYCLES_PER_USEC;
+    if (next - sent < quiet) continue;
+    bool stable = true;
+    for (size_t j = frameAfter(next - quiet); j < last; j++) stable &= frames[j].bytes == target;
+    if (!stable) continue;
+    size_t done = changed;
+    while (frames[done].bytes != target) done++;
+    settled.push_back((frames[done].end - sent) / CYCLES_PER_USEC);
+  }
+
+  for (size_t at = replies.find("ERROR"); at != std::string::npos; at = replies.find("ERROR", at + 1)) {
+    replyErrors++;
+  }
+
+  printf("%s: %u commands, %d selections, %u frames, %d errors\n", path,
+    (unsigned int)commands.size(), selections, (unsigned int)frames.size(), replyErrors);
+  report("frame", firstFrame);
+  report("fade", settled);
+  printf("selections received %lu applied %lu, mailbox %s\n", (unsigned long)selections,
+    (unsigned long)selectionsApplied, SELECTION_MAILBOX ? "on" : "bypassed");
+
+  int allocatingSelections = reportAllocs();
+
+  // The firmware's own view, from the first byte of each `set`
+  replies.clear();
+  sendLine("latency");
+  runUntil(hostCycles + 100 * 1000 * CYCLES_PER_USEC);
+  for (size_t at = replies.find("LATENCY: "); at != std::string::npos; at = replies.find("LATENCY: ", at + 1)) {
+    printf("device %s\n", replies.substr(at, replies.find_first_of("\r\n", at) - at).c_str());
+  }
+
+  if (budget && percentile(firstFrame, 99) > budget) {
+    printf("p99 to the first changed frame is over %lu us\n", budget);
+    return 1;
+  }
+  if (allocatingSelections) {
+    printf("selection commands allocate\n");
+    return 1;
+  }
+  return replyErrors ? 1 : 0;
+}
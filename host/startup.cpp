@@ -0,0 +1,75 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Boot to first frame benchmark
+*
+* startup-bench [-m <usec>]
+*
+* Boots the host build of the firmware and reports the time from setup()
+* starting to the end of the first frame on the wire, next to the firmware's
+* own `STATS: first frame` when it has one. With -m it fails when there is no
+* frame within that many microseconds. The Makefile builds it statically
+* linked with -Os, for the current firmware and for the one before iostream
+* and the STL containers were dropped, and prints the size of both.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "application.h"
+
+#include <unistd.h>
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define STARTUP_LOOP_USEC 100   // System thread time between loop() calls
+#define STARTUP_LIMIT_MSEC 1000 // Give up on a first frame after this long
+
+#define CYCLES_PER_USEC (HOST_CPU_HZ / 1000000)
+
+
+// =------------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  unsigned long budget = 0;
+  int option;
+  while ((option = getopt(argc, argv, "m:")) != -1) {
+    if (option != 'm') {
+      fprintf(stderr, "usage: startup-bench [-m <usec>]\n");
+      return 2;
+    }
+    budget = strtoul(optarg, NULL, 10);
+  }
+
+  uint64_t start = hostCycles;
+  hostSetup();
+  while (hostWire.empty() && hostCycles - start < (uint64_t)STARTUP_LIMIT_MSEC * 1000 * CYCLES_PER_USEC) {
+    hostAdvance(STARTUP_LOOP_USEC * CYCLES_PER_USEC);
+    hostLoop();
+  }
+  if (hostWire.empty()) {
+    printf("%s: no frame within %d ms, it waits for a command\n", name, STARTUP_LIMIT_MSEC);
+    return budget ? 1 : 0;
+  }
+  unsigned long wire = (hostWire.front().end - start) / CYCLES_PER_USEC;
+
+  // The firmware's own figure, from builds that report one
+  Serial.output.clear();
+  for (const char *c = "stats\n"; *c; c++) Serial.input.push_back(*c);
+  for (int i = 0; i < 100; i++) {
+    hostAdvance(STARTUP_LOOP_USEC * CYCLES_PER_USEC);
+    hostLoop();
+    Serial.writable = HOST_SERIAL_BUFFER;
+  }
+  size_t at = Serial.output.find("STATS: first frame ");
+  if (at == std::string::npos) {
+    printf("%s: first frame %6lu us on the wire\n", name, wire);
+  } else {
+    printf("%s: first frame %6lu us on the wire, %6lu us in stats\n", name, wire,
+      strtoul(Serial.output.c_str() + at + 19, NULL, 10));
+  }
+  if (budget && wire > budget) {
+    printf("first frame is over %lu us\n", budget);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Virtual NeoPixel strip for the host build
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "strip.h"
+#include "neopixel.h"
+
+
+// =----------------------------------------------------------------= Types =--=
+// How a pixel type tells its bits apart: the width of the pulse away from the
+// idle level, against the midpoint of the 0 and 1 widths show() sends
+struct pixelProtocol {
+  uint8_t type;
+  bool activeHigh;    // TM1829 idles high and pulses low
+  uint32_t threshold; // ns, wider pulses are 1 bits
+  const char *order;  // Color of each byte in a pixel
+};
+
+static const pixelProtocol protocols[] = {
+  { WS2812B,    true,  475,  "grb"  }, // 300 / 650 ns, widest 0 and narrowest 1 of both profiles
+  { WS2812B2,   true,  475,  "grb"  },
+  { WS2811,     true,  850,  "rgb"  }, // 500 / 1200 ns
+  { TM1803,     true,  1020, "rgb"  }, // 680 / 1360 ns
+  { TM1829,     false, 550,  "rbg"  }, // 300 / 800 ns low
+  { SK6812RGBW, true,  450,  "rgbw" }, // 300 / 600 ns
+};
+
+
+// =-------------------------------------------------------------= Decoding =--=
+static const pixelProtocol &protocolFor(uint8_t type) {
+  for (const pixelProtocol &protocol : protocols) {
+    if (protocol.type == type) return protocol;
+  }
+  return protocols[0]; // The library falls back to the WS2812B timing too
+}
+
+uint32_t cyclesToNs(uint64_t cycles) {
+  return cycles * 1000 / (HOST_CPU_HZ / 1000000);
+}
+
+static void widen(widthRange &range, uint32_t width) {
+  if (width < range.shortest) range.shortest = width;
+  if (width > range.longest) range.longest = width;
+}
+
+// Turn each pulse into a bit, most significant first, and time the gap after
+// it up to the next pulse; the last bit's gap is the latch and is not timed. A
+// pin already at the active level when the frame starts pulses from the start
+// of the frame.
+bool decodeFrame(const wireFrame &frame, uint8_t type, decodedFrame &decoded) {
+  const pixelProtocol &protocol = protocolFor(type);
+  decoded.bytes.clear();
+  decoded.wireNs = cyclesToNs(frame.end - frame.start);
+  for (int bit = 0; bit < 2; bit++) {
+    decoded.pulse[bit] = decoded.gap[bit] = { UINT32_MAX, 0 };
+  }
+  decoded.error = NULL;
+
+  bool active = frame.idleHigh == protocol.activeHigh;
+  uint64_t pulseStart = frame.start, pulseEnd = 0;
+  int lastBit = -1;
+  uint32_t bits = 0;
+  uint8_t value = 0;
+  for (const pinEdge &edge : frame.edges) {
+    if (edge.high == protocol.activeHigh) {
+      if (lastBit >= 0) widen(decoded.gap[lastBit], cyclesToNs(edge.cycle - pulseEnd));
+      active = true;
+      pulseStart = edge.cycle;
+      continue;
+    }
+    if (!active) continue;
+
+    uint32_t width = cyclesToNs(edge.cycle - pulseStart);
+    int bit = width > protocol.threshold;
+    widen(decoded.pulse[bit], width);
+    value = value << 1 | bit;
+    if (++bits % 8 == 0) decoded.bytes.push_back(value);
+    active = false;
+    pulseEnd = edge.cycle;
+    lastBit = bit;
+  }
+
+  if (active) decoded.error = "frame ends mid-pulse";
+  else if (bits % 8 != 0) decoded.error = "frame ends mid-byte";
+  return decoded.error == NULL;
+}
+
+// A decoded pixel as getPixelColor() packs it, white in the top byte
+uint32_t decodedColor(const decodedFrame &decoded, uint8_t type, uint16_t pixel) {
+  const pixelProtocol &protocol = protocolFor(type);
+  size_t size = strlen(protocol.order);
+  uint32_t color = 0;
+  for (size_t i = 0; i < size && pixel * size + i < decoded.bytes.size(); i++) {
+    int shift = protocol.order[i] == 'w' ? 24 : protocol.order[i] == 'r' ? 16 : protocol.order[i] == 'g' ? 8 : 0;
+    color |= (uint32_t)decoded.bytes[pixel * size + i] << shift;
+  }
+  return color;
+}
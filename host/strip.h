@@ -0,0 +1,37 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Virtual NeoPixel strip for the host build
+*
+* Decodes the pin edges of one show() back into the bytes on the wire, the way
+* the pixels would latch them, and times the frame.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#ifndef HOST_STRIP_H
+#define HOST_STRIP_H
+
+#include "application.h"
+
+
+// =----------------------------------------------------------------= Types =--=
+struct widthRange {
+  uint32_t shortest, longest;  // ns
+};
+
+struct decodedFrame {
+  std::vector<uint8_t> bytes;  // Wire order, as in the strip buffer
+  uint32_t wireNs;             // From interrupts off to back on
+  widthRange pulse[2];         // Away from the idle level, T0H and T1H
+  widthRange gap[2];           // Back at idle until the next bit, T0L and T1L
+  const char *error;           // Why the frame did not decode, NULL when it did
+};
+
+
+// =-----------------------------------------------------------= Prototypes =--=
+bool decodeFrame(const wireFrame &frame, uint8_t type, decodedFrame &decoded);
+uint32_t decodedColor(const decodedFrame &decoded, uint8_t type, uint16_t pixel);
+uint32_t cyclesToNs(uint64_t cycles);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+* ==============================================================================
+* The Monitor Monitor - Virtual strip check for every show() variant
+*
+* strip-check [<pixels>]
+*
+* Runs show() for each pixel type and timing profile on the host build,
+* decodes the recorded pin edges and checks every pixel against the strip
+* buffer bit for bit. Prints the wire time per frame and the narrowest and
+* widest T0H, T0L, T1H and T1L seen, and exits non-zero on any mismatch or on
+* any width outside the pixel's datasheet window.
+*
+* Widths come from the cycles show() is charged for: one per delay
+* instruction and HOST_PIN_CYCLES per pin write, which brings the nop timed
+* loops within a few percent of the widths measured on a Photon, and for the
+* DWT timed loop its wait plus the DWT_OVERHEAD_* cycles measured around it.
+*
+* License: MIT
+* ==============================================================================
+*/
+
+#include "strip.h"
+#include "neopixel.h"
+
+
+// =--------------------------------------------------------------= Defines =--=
+#define CHECK_PIXELS 16     // Pixels per strip unless given
+#define CHECK_TOLERANCE 150 // ns either side of the nominal widths, as the datasheets give
+
+
+// =----------------------------------------------------------------= Types =--=
+// Nominal datasheet widths in ns, away from idle then back at idle, for a 0
+// bit then a 1 bit. TM1829 pulses low.
+struct bitWidths {
+  uint32_t t0h, t0l, t1h, t1l;
+};
+
+struct stripVariant {
+  const char *name;
+  uint8_t type;
+  uint8_t timing;
+  bitWidths nominal;
+};
+
+static const stripVariant variants[] = {
+  { "WS2812B",    WS2812B,    TIMING_DEFAULT, { 400, 850,  800,  450  } },
+  { "WS2812B",    WS2812B,    TIMING_TIGHT,   { 400, 850,  800,  450  } },
+  { "WS2812B2",   WS2812B2,   TIMING_DEFAULT, { 400, 850,  800,  450  } },
+  { "WS2811",     WS2811,     TIMING_DEFAULT, { 500, 2000, 1200, 1300 } },
+  { "TM1803",     TM1803,     TIMING_DEFAULT, { 680, 1360, 1360, 680  } },
+  { "TM1829",     TM1829,     TIMING_DEFAULT, { 300, 800,  800,  300  } },
+  { "SK6812RGBW", SK6812RGBW, TIMING_DEFAULT, { 300, 900,  600,  600  } },
+};
+
+
+// =-------------------------------------------------------------= Checking =--=
+// Colors covering all-zero, all-one and alternating bits in every channel
+static uint32_t patternColor(uint16_t pixel) {
+  static const uint8_t levels[] = { 0x00, 0xFF, 0xAA, 0x55, 0x01, 0x80, 0x7E, 0x0F };
+  return (uint32_t)levels[(pixel + 3) % 8] << 24 | (uint32_t)levels[pixel % 8] << 16 |
+         (uint32_t)levels[(pixel + 1) % 8] << 8 | levels[(pixel + 2) % 8];
+}
+
+// What the pixel should light up as: no white channel but on SK6812RGBW, and
+// the library keeps TM1829 red below 255
+static uint32_t expectedColor(uint8_t type, uint16_t pixel) {
+  uint32_t color = patternColor(pixel);
+  if (type != SK6812RGBW) color &= 0xFFFFFF;
+  if (type == TM1829 && (color & 0xFF0000) == 0xFF0000) color -= 0x010000;
+  return color;
+}
+
+static bool withinWindow(const widthRange &range, uint32_t nominal) {
+  return range.shortest == UINT32_MAX ||
+         (range.shortest + CHECK_TOLERANCE >= nominal && range.longest <= nominal + CHECK_TOLERANCE);
+}
+
+// Which width strays outside its datasheet window, NULL when none does
+static const char *checkWidths(const decodedFrame &decoded, const bitWidths &nominal) {
+  if (!withinWindow(decoded.pulse[0], nominal.t0h)) return "T0H outside the datasheet window";
+  if (!withinWindow(decoded.gap[0], nominal.t0l)) return "T0L outside the datasheet window";
+  if (!withinWindow(decoded.pulse[1], nominal.t1h)) return "T1H outside the datasheet window";
+  if (!withinWindow(decoded.gap[1], nominal.t1l)) return "T1L outside the datasheet window";
+  return NULL;
+}
+
+static void printRange(const char *name, const widthRange &range) {
+  if (range.shortest == UINT32_MAX) printf("  %s     -     ", name);
+  else printf("  %s %4lu-%4lu", name, (unsigned long)range.shortest, (unsigned long)range.longest);
+}
+
+static bool checkVariant(const stripVariant &variant, uint16_t pixels) {
+  Adafruit_NeoPixel strip(pixels, D2, variant.type);
+  strip.begin();
+  strip.setTiming(variant.timing);
+  for (uint16_t i = 0; i < pixels; i++) strip.setPixelColor(i, patternColor(i));
+
+  // Two frames, the second one starts from the pin level the first left
+  decodedFrame decoded;
+  const char *error = NULL;
+  for (int frame = 0; frame < 2 && !error; frame++) {
+    hostWire.clear();
+    strip.show();
+    if (hostWire.size() != 1) error = "no frame on the wire";
+    else if (!decodeFrame(hostWire[0], variant.type, decoded)) error = decoded.error;
+    else if (decoded.bytes.size() != pixels * (variant.type == SK6812RGBW ? 4u : 3u) ||
+             memcmp(decoded.bytes.data(), strip.getPixels(), decoded.bytes.size()) != 0) {
+      error = "bytes differ from the strip buffer";
+    } else {
+      error = checkWidths(decoded, variant.nominal);
+    }
+    for (uint16_t i = 0; i < pixels && !error; i++) {
+      uint32_t color = decodedColor(decoded, variant.type, i);
+      if (color != expectedColor(variant.type, i)) error = "colors differ from those set";
+      else if (color != strip.getPixelColor(i)) error = "getPixelColor() differs";
+    }
+  }
+
+  printf("%-10s %-7s %4u pixels  wire %7.1f us", variant.name,
+    variant.timing == TIMING_TIGHT ? "tight" : "default", pixels, decoded.wireNs / 1000.0);
+  printRange("T0H", decoded.pulse[0]);
+  printRange("T0L", decoded.gap[0]);
+  printRange("T1H", decoded.pulse[1]);
+  printRange("T1L", decoded.gap[1]);
+  printf(" ns  %s\n", error ? error : "ok");
+  return error == NULL;
+}
+
+
+// =-----------------------------------------------------------------= Main =--=
+int main(int argc, char **argv) {
+  uint16_t pixels = argc > 1 ? atoi(argv[1]) : CHECK_PIXELS;
+  int failed = 0;
+  for (const stripVariant &variant : variants) {
+    if (!checkVariant(variant, pixels)) failed++;
+  }
+  return failed ? 1 : 0;
+}
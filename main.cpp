@@ -8,52 +8,549 @@
 * ==============================================================================
 */
 
-#include <string>
-#include <sstream>
-#include <vector>
-#include <map>
-
 #include "neopixel/neopixel.h"
 #include "application.h"
+#include <malloc.h>
+
+// Run the cloud connection on its own thread so loop() and the frame tick
+// never wait on it; cloud functions hand their commands over through a queue
+SYSTEM_THREAD(ENABLED);
 
 
 // =--------------------------------------------------------------= Defines =--=
+#ifndef PIXEL_COUNT
 #define PIXEL_COUNT 10
+#endif
 #define PIXEL_PIN D2
 #define PIXEL_TYPE WS2812B
 // pixel type [ WS2812, WS2812B, WS2812B2, WS2811, TM1803, TM1829, SK6812RGBW ]
 // note: If not specified, WS2812B is selected for you.
 // note: RGB order is automatically applied to WS2811,
 //       WS2812/WS2812B/WS2812B2/TM1803 is GRB order.
+#define PIXEL_TIMING TIMING_DEFAULT
+// bit timing [ TIMING_DEFAULT, TIMING_TIGHT ]
+// note: TIMING_TIGHT sends the shortest pulses the WS2812B spec allows, so
+//       interrupts are off for less time per frame. WS2812B/WS2812B2 only.
+#define PIXEL_BYTES (PIXEL_COUNT * (PIXEL_TYPE == SK6812RGBW ? 4 : 3))
 
+#define INDICATOR_COUNT 10       // Number of indicators, each lights a segment of pixels [n <= 32]
 #define SCREEN_COUNT 20          // Number of screens that can be stored
 #define COMMAND_BUFFER_SIZE 128  // How long can an incoming command string be
-#define INDICATOR_COLOR 55       // Color as angle [0 <= n < 360]
-#define INDICATOR_BRIGHTNESS 128 // Global indicator brightness [0 <= n < 256]
+#define COMMAND_MAX_PARAMS 8     // Most space separated words in a command
+#define COMMAND_MAX_TOKENS (COMMAND_MAX_PARAMS + 2) // The command and its parameters, after a tag
+#define SERIAL_BYTES_PER_LOOP 64 // Max bytes consumed per serialEvent() call
+#define COMMAND_QUEUE_SIZE 4     // Commands waiting per source [power of 2]
+#define INDICATOR_COLOR 55       // Default color as wheel position [0 <= n < 256]
+#define INDICATOR_BRIGHTNESS 128 // Default indicator brightness [0 <= n < 256]
+
+// Power Budget
+#define POWER_BUDGET_MA 400 // Current the strip may draw, 0 for no limit; leaves USB headroom for the Photon
+#define POWER_CHANNEL_MA 20 // Current per color channel at full level
+#define POWER_IDLE_MA 1     // Current per pixel when dark
 
 // LED Fading
-#define FADE_DURATION_MSEC 250
+#define FADE_DURATION_MSEC 250      // Default fade duration
+#define FADE_LEVEL_MAX 65535        // Indicator level when fully lit
 #define FADE_UPDATE_INTERVAL_MSEC 33 // ~30fps
+#define FADE_PLAN_FRAMES_MAX 16     // Frames pre-rendered per transition, longer fades re-plan
+#define FADE_PLAN_BYTES 6144        // RAM for the pre-rendered frames, long strips plan fewer at a time
+#define FADE_PLAN_FRAMES (FADE_PLAN_BYTES / PIXEL_BYTES < FADE_PLAN_FRAMES_MAX ? \
+                          FADE_PLAN_BYTES / PIXEL_BYTES : FADE_PLAN_FRAMES_MAX)
+
+// Selection Commands
+#ifndef SELECTION_MAILBOX
+#define SELECTION_MAILBOX 1 // 0 applies each selection as it arrives, to compare against the mailbox
+#endif
+
+// Event Tracing
+#define TRACE_SIZE 128 // Number of events kept in the trace ring [power of 2]
+
+// Latency Statistics
+#define LATENCY_SAMPLES 64 // Number of recent set commands kept for percentiles
+
+// Command Capture
+#define CAPTURE_SIZE 32 // Number of recent set/add/remove commands kept for replay
+#define REPLAY_CYCLES_PER_USEC 120 // Core clock in MHz, replays are timed with the DWT cycle counter
+
+// EEPROM Layout
+#define SCREEN_EEPROM_ADDRESS 0    // Screen registry
+#define SEGMENT_EEPROM_ADDRESS 512 // Indicator to pixel segment mapping
+#define ACTIVE_EEPROM_ADDRESS 1024 // Ring of active indicator slots, restored at boot
+#define ACTIVE_RING_SLOTS 16       // Slots in the ring, spreads wear across them
+#define ACTIVE_RECORD_MAGIC 0x5A   // Mixed into each slot's check byte
+#define ACTIVE_PERSIST_DELAY_MSEC 5000 // How long a set must be stable before it is stored
+#define ANIMATION_EEPROM_ADDRESS 1280  // Animation programs
+#define ALIAS_EEPROM_ADDRESS 1536      // Display name aliases
+
+// Animations
+#define ANIMATION_COUNT 4             // Programs stored in EEPROM
+#define ANIMATION_SIZE 48             // Bytes of bytecode per program
+#define ANIMATION_CYCLES_PER_FRAME 64 // Instructions run per frame before yielding
+#define ANIMATION_LOOP_DEPTH 2        // Nested repeat levels
+
+// Display Aliases
+#define ALIAS_COUNT 16       // Names that can be stored
+#define ALIAS_ARENA_SIZE 160 // Bytes for every name and its terminator [n <= 256]
+#define ALIAS_NAME_MAX 15    // Longest name
+#define ALIAS_SLOTS 32       // Hash index slots, at least twice ALIAS_COUNT [power of 2]
+
+// Frame Streaming
+#define STREAM_MAGIC 0xA5             // First byte of every frame header
+#define STREAM_HEADER_SIZE 8          // magic, encoding, length:2, checksum:4
+#define STREAM_BYTES_PER_LOOP 512     // Max frame bytes consumed per serialEvent() call
+#define STREAM_BYTE_TIMEOUT_MSEC 100  // A frame stalled this long is dropped
+#define STREAM_IDLE_MSEC 5000         // Streaming ends after this long without a frame
+
+// Serial Output
+#define TX_BUFFER_SIZE 1024 // Reply bytes waiting for the host [power of 2]
+#define TX_LINE_MAX 160     // Longest reply line, commands wait for this much room
+#define REPLY_TAG_SIZE 12   // Longest command tag echoed in a reply, with its terminator
+
+// Heap Instrumentation
+#define HEAP_TRACKING 1     // Count allocations made through new/delete
+#define HEAP_HEADER_SIZE 8  // Bytes in front of each block holding its size
+#define HEAP_UNCOUNTED ((size_t)1 << (sizeof(size_t) * 8 - 1)) // Header flag of a block left out of the counts
+#ifndef HEAP_COUNTED
+#define HEAP_COUNTED() true // Whether an allocation made now is counted, a host build leaves its own out
+#endif
 
 
 // =--------------------------------------------------------------= Globals =--=
 Adafruit_NeoPixel strip = Adafruit_NeoPixel(PIXEL_COUNT, PIXEL_PIN, PIXEL_TYPE);
-float indicatorBrightness[PIXEL_COUNT];
-int currentIndicator;
-int serialCounter = 0;
-std::stringstream serialBuffer;
-std::map<std::string, int> screenMap;
+uint16_t indicatorLevel[INDICATOR_COUNT];      // Fade level [0 <= n <= FADE_LEVEL_MAX]
+uint32_t indicatorColor[INDICATOR_COUNT];      // Color at full level, profile applied
+unsigned short indicatorFade[INDICATOR_COUNT]; // Fade duration in msec
+byte indicatorCurve[INDICATOR_COUNT];          // Fade curve, CURVE_* with CURVE_GAMMA
+uint32_t activeIndicators = 0;  // Bitset of indicators to light
+uint32_t fadingIndicators = 0;  // Bitset of indicators not yet at their target
+uint32_t restyledIndicators = 0; // Bitset of indicators whose color or curve changed since drawn
+uint32_t indicatorScreen[INDICATOR_COUNT]; // Display whose profile each indicator has, 0 for the default
+
+// Latest-wins mailbox for selection commands. A burst of them between two
+// frames only leaves its final active set here, applied at the next frame.
+bool selectionPending = false;
+uint32_t pendingIndicators = 0;       // Active set to apply
+uint32_t pendingProfiles = 0;         // Indicators with a profile in pendingProfile
+
+// Transition frames pre-rendered when the active set changes, the frame tick
+// only copies the one that is due into the strip. The plan takes at most
+// FADE_PLAN_BYTES whatever the strip length: 16 frames up to 128 RGB pixels,
+// 2 frames at 1000.
+static_assert(PIXEL_BYTES <= FADE_PLAN_BYTES, "a fade plan frame does not fit in FADE_PLAN_BYTES");
+uint8_t fadePlan[FADE_PLAN_FRAMES][PIXEL_BYTES];
+uint32_t fadePlanSum[FADE_PLAN_FRAMES]; // strip.getLevelSum() of each frame, for setPixels()
+int fadePlanFrames = 0;                 // Frames rendered into fadePlan
+int fadePlanShown = -1;                 // Last frame shown, -1 before the first
+unsigned long fadePlanStart = 0;        // millis() the plan was made
+uint32_t fadePlanActive = 0;            // activeIndicators the plan fades toward
+uint32_t fadePlanFading = 0;            // Indicators the plan fades
+uint16_t fadePlanLevel[INDICATOR_COUNT]; // Level each fading indicator starts at
+uint32_t fadePlanStep[INDICATOR_COUNT];  // Level change per frame
+
+
+// =-------------------------------------------------------= Command Queues =--=
+// Serial and cloud intake each fill a single-producer/single-consumer ring of
+// tokenized commands, loop() drains both between frames. Serial is read on
+// the application thread, cloud functions run on the system thread, so each
+// ring has exactly one writer and the registry is only touched by loop().
+struct commandRecord {
+  char line[COMMAND_BUFFER_SIZE];
+  char *tokens[COMMAND_MAX_TOKENS];     // Point into line
+  int count;                            // Tokens found in line
+  uint32_t startTime;                   // micros() at the first byte
+};
+
+struct commandQueue {
+  commandRecord records[COMMAND_QUEUE_SIZE];
+  uint32_t head; // Records pushed, only written by the producer
+  uint32_t tail; // Records run, only written by the consumer
+};
+
+commandQueue serialQueue;
+commandQueue cloudQueue;
+int serialCounter = 0;         // Bytes of the line being read
+uint32_t lineStartTime = 0;    // micros() at the first byte of that line
+uint32_t cloudDropped = 0;     // Cloud commands refused with the queue full
+uint32_t selections = 0;          // Selection commands accepted
+uint32_t selectionsCoalesced = 0; // Of those, replaced by a later one before a frame
+uint32_t selectionsApplied = 0;   // Active sets taken from the mailbox
+
+
+// =--------------------------------------------------------= Serial Output =--=
+// Replies are queued in a ring and written out as the USB buffer takes them,
+// so a host that reads slowly, or not at all, never holds up loop(). A reply
+// longer than a line is written by a listing cursor, one line each time the
+// ring has room, and commands wait until it is done.
+typedef bool (*listingLine)(uint32_t position); // Writes one line, false past the last
+
+struct listingCursor {
+  listingLine next;     // NULL when no listing is being written
+  uint32_t position;    // Line to write next
+  uint32_t first, last; // Sequence numbers to dump, for the trace and capture rings
+};
+
+static_assert((TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) == 0 && TX_BUFFER_SIZE >= 2 * TX_LINE_MAX,
+  "reply ring must be a power of 2 holding at least two lines");
+
+char txRing[TX_BUFFER_SIZE];
+uint32_t txHead = 0;    // Bytes queued, ring index is head % size
+uint32_t txTail = 0;    // Bytes handed to Serial, ring index is tail % size
+uint32_t txMax = 0;     // Most bytes ever waiting in the ring
+uint32_t txStalls = 0;  // Times queued commands waited for the ring
+uint32_t txDropped = 0; // Lines dropped with the ring full
+listingCursor listing = {};
+char replyTag[REPLY_TAG_SIZE] = ""; // `#<tag>` of the running command, put in front of its OK or ERROR
+
+
+// =--------------------------------------------------------------= Tracing =--=
+enum traceEventId {
+  TRACE_BYTE_RECEIVED = 1,
+  TRACE_COMMAND_PARSED,
+  TRACE_INDICATOR_CHANGED,
+  TRACE_FRAME_RENDERED,
+  TRACE_SHOW_COMPLETE,
+  TRACE_EEPROM_WRITTEN
+};
+
+struct traceEvent {
+  uint32_t time; // micros() when the event was recorded
+  uint16_t arg;  // event specific argument
+  byte id;       // traceEventId
+};
+
+traceEvent traceRing[TRACE_SIZE];
+uint32_t traceCount = 0; // Total events recorded, ring index is count % size
+
+
+// =------------------------------------------------------------= Latency =--=
+// Command-to-photon latency, measured from the first byte of a `set` line to
+// the first frame showing the change and to the frame that finishes the fade
+struct latencySamples {
+  uint32_t samples[LATENCY_SAMPLES]; // microseconds, ring of recent samples
+  uint32_t count;                    // Total samples recorded
+  uint32_t max;                      // Largest sample ever recorded
+};
+
+latencySamples frameLatency;
+latencySamples fadeLatency;
+unsigned long commandStartTime = 0; // micros() at the first byte of the running command
+unsigned long latencyStartTime = 0; // micros() at the start of the pending set
+bool framePending = false;          // Waiting for the first changed frame
+bool fadePending = false;           // Waiting for the fade to complete
+
+
+// =-----------------------------------------------------------= Statistics =--=
+uint32_t framesShown = 0;  // Frames written out to the strip
+uint32_t wireTimeMax = 0;  // Longest show() bitstream in microseconds
+uint64_t wireTimeSum = 0;  // Total show() bitstream time for the average
+uint32_t frameIntervalMax = 0; // Longest gap between frame updates in msec
+uint32_t serialBytes = 0;      // Bytes read from Serial
+uint32_t serialCommands = 0;   // Command lines handed to the parser
+uint32_t serialOverflows = 0;  // Lines cut at COMMAND_BUFFER_SIZE
+uint32_t frameChecksum = 2166136261UL; // FNV-1a over every frame shown
+uint32_t setupStartTime = 0;   // micros() when setup() started
+uint32_t firstFrameTime = 0;   // Microseconds from setup() to the first frame
+
+
+// =-------------------------------------------------------= Capture/Replay =--=
+struct capturedCommand {
+  uint32_t time;                   // millis() when the command was received
+  char line[COMMAND_BUFFER_SIZE];  // Command line without the newline
+};
+
+capturedCommand captureRing[CAPTURE_SIZE];
+uint32_t captureCount = 0;   // Total commands captured, index is count % size
+bool replayActive = false;   // Replaying, suppresses capture
+bool replayFast = false;     // Ignore captured timing and replay back to back
+uint32_t replayNext = 0;     // Capture sequence number of the next command
+uint32_t replayEnd = 0;      // Capture sequence number to stop at
+uint32_t replayStartTime = 0;     // millis() when the replay started
+uint32_t replayStartFrames = 0;   // framesShown when the replay started
+uint32_t replayStartAllocs = 0;   // heapAllocs when the replay started
+uint64_t replayCycles = 0;        // Cycles spent running the replayed commands
+uint32_t replayChecksum = 0;      // FNV-1a over the frames shown since the replay started
+uint32_t replayIndicators = 0;    // Active set to bring back once the replay reports
+
+
+// =------------------------------------------------------------= Animation =--=
+// A tiny bytecode VM for effects. While a program plays it owns the strip,
+// each frame runs it until it waits, ramps or spends its cycle budget.
+enum animationOp {
+  OP_END,    //                     Stop, the indicators come back
+  OP_COLOR,  // <r> <g> <b>         Set the color register
+  OP_RANGE,  // <start:2> <count:2> Set the pixel range, big endian
+  OP_FILL,   // <level>             Fill the range with the color at a level
+  OP_RAMP,   // <level> <frames>    Fill the range once a frame, moving to a level
+  OP_WAIT,   // <frames>            End the frame and hold it for more frames
+  OP_REPEAT, // <count>             Run up to the matching OP_NEXT count times, 0 forever
+  OP_NEXT,   //                     End of a repeated block
+  OP_BLEND,  // <amount>            Move each pixel in the range toward the color
+  OP_MOVE,   // <delta>             Shift the range, signed, wrapping around the strip
+  OP_COUNT
+};
+
+const byte animationOpLength[OP_COUNT] = { 1, 4, 5, 2, 3, 2, 2, 1, 2, 2 };
+
+struct animationState {
+  byte code[ANIMATION_SIZE];
+  byte length;
+  byte pc;
+  uint32_t color;
+  uint16_t start, count;
+  byte level;
+  byte wait;                  // Frames left to hold
+  byte rampFrom, rampTo;
+  byte rampFrame, rampFrames; // Ramp in progress while rampFrames > 0
+  byte depth;
+  struct {
+    byte start;               // pc of the first instruction in the block
+    byte remaining;           // Runs left, 0 repeats forever
+  } loops[ANIMATION_LOOP_DEPTH];
+};
+
+animationState animation;
+bool animationActive = false;
+uint32_t animationFrames = 0;   // Frames the VM has run
+uint32_t animationTimeMax = 0;  // Longest frame in the VM in microseconds
+uint64_t animationTimeSum = 0;  // Total VM time for the average
+
+
+// =------------------------------------------------------------= Streaming =--=
+// After `stream` Serial carries binary frames from the host instead of
+// commands. Each is a header then its payload, written straight into the
+// strip buffer in strip byte order and shown once the checksum matches.
+enum streamEncoding {
+  STREAM_RAW = 0x00, // PIXEL_BYTES as they go on the wire
+  STREAM_RLE = 0x01, // Runs of <count> <one pixel's bytes>, count 1-255
+  STREAM_END = 0xFF  // No payload, leave streaming
+};
+
+bool streamActive = false;
+byte streamHeader[STREAM_HEADER_SIZE];
+int streamHeaderCount = 0;         // Header bytes read, 0 between frames
+byte streamEncoding = STREAM_RAW;
+uint16_t streamLength = 0;         // Payload bytes in the frame
+uint16_t streamReceived = 0;       // Payload bytes read so far
+uint32_t streamExpected = 0;       // Checksum from the header
+uint32_t streamHash = 0;           // FNV-1a over the payload read so far
+uint16_t streamOffset = 0;         // Pixel bytes written, past PIXEL_BYTES when a run overflows
+uint32_t streamLevel = 0;          // Sum of the pixel bytes written, for the power estimate
+byte streamRun[5];                 // RLE count and pixel being read
+int streamRunCount = 0;
+unsigned long streamLastByte = 0;  // millis() of the last frame byte
+unsigned long streamLastFrame = 0; // millis() of the last frame shown
+uint32_t streamFrames = 0;         // Frames shown
+uint32_t streamErrors = 0;         // Frames dropped
+
+
+// =-----------------------------------------------------------------= Heap =--=
+enum commandType {
+  COMMAND_SET,
+  COMMAND_SELECT,
+  COMMAND_DESELECT,
+  COMMAND_CLEAR,
+  COMMAND_ADD,
+  COMMAND_REMOVE,
+  COMMAND_LIST,
+  COMMAND_OTHER,
+  COMMAND_TYPES
+};
+
+const char *commandNames[COMMAND_TYPES] = {
+  "set", "select", "deselect", "clear", "add", "remove", "list", "other"
+};
+
+uint32_t heapAllocs = 0;     // Allocations through new
+uint32_t heapFrees = 0;      // Frees through delete
+uint32_t heapLiveBytes = 0;  // Bytes currently allocated through new
+uint32_t heapPeakBytes = 0;  // High water mark of heapLiveBytes
+int lastCommandType = COMMAND_OTHER;    // Type of the most recently parsed command
+uint32_t commandLines[COMMAND_TYPES];   // Command lines handled per command type
+uint32_t commandAllocs[COMMAND_TYPES];  // Allocations made per command type
+
+#if HEAP_TRACKING
+// Replace the global allocator to count every STL and new allocation. Each
+// block carries its size in a header so delete can account for it, flagged
+// when the block was left out of the counts.
+void *operator new(size_t size) {
+  byte *block = (byte *)malloc(size + HEAP_HEADER_SIZE);
+  if (!block) return NULL;
+
+  if (!HEAP_COUNTED()) {
+    *(size_t *)block = size | HEAP_UNCOUNTED;
+    return block + HEAP_HEADER_SIZE;
+  }
+
+  *(size_t *)block = size;
+  ATOMIC_BLOCK() { // The system thread allocates too
+    heapAllocs++;
+    heapLiveBytes += size;
+    if (heapLiveBytes > heapPeakBytes) heapPeakBytes = heapLiveBytes;
+  }
+
+  return block + HEAP_HEADER_SIZE;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *ptr) {
+  if (!ptr) return;
+
+  byte *block = (byte *)ptr - HEAP_HEADER_SIZE;
+  size_t size = *(size_t *)block;
+  if (!(size & HEAP_UNCOUNTED)) {
+    ATOMIC_BLOCK() {
+      heapFrees++;
+      heapLiveBytes -= size;
+    }
+  }
+  free(block);
+}
+
+void operator delete[](void *ptr) {
+  operator delete(ptr);
+}
+#endif
+
+
+// =----------------------------------------------------------= Fade Curves =--=
+// A fade moves an indicator's level linearly in time. Its curve maps that
+// level to the one colors are scaled by, through a 256 entry table built at
+// compile time: one lookup per segment per frame.
+#define CURVE_LINEAR 0      // Level as is
+#define CURVE_EASE 1        // Ease in and out, smoothstep
+#define CURVE_EXPONENTIAL 2 // Doubles every tenth of the fade
+#define CURVE_COUNT 3
+#define CURVE_GAMMA 0x80    // Treat the level as perceived lightness (CIE L*)
+#define CURVE_STEPS 256
+
+const char *curveNames[CURVE_COUNT] = { "linear", "ease", "exp" };
+
+struct curveTable {
+  uint16_t level[CURVE_STEPS];
+};
+
+constexpr double curvePower(double base, unsigned int exponent) {
+  return exponent == 0 ? 1.0 : base * curvePower(base, exponent - 1);
+}
+
+// 2^10 after the last step, so the curve spans ten doublings
+constexpr double CURVE_EXPONENTIAL_BASE = 1.0275550497734123;
+
+constexpr double curveEase(unsigned int curve, unsigned int step) {
+  return curve == CURVE_EASE
+    ? (step / 255.0) * (step / 255.0) * (3.0 - 2.0 * step / 255.0)
+    : curve == CURVE_EXPONENTIAL
+    ? (curvePower(CURVE_EXPONENTIAL_BASE, step) - 1.0) /
+      (curvePower(CURVE_EXPONENTIAL_BASE, CURVE_STEPS - 1) - 1.0)
+    : step / 255.0;
+}
+
+// Relative luminance of a CIE L* lightness, both as [0, 1]
+constexpr double curveLightness(double lightness) {
+  return lightness > 0.08
+    ? curvePower((100.0 * lightness + 16.0) / 116.0, 3)
+    : 100.0 * lightness / 903.3;
+}
+
+constexpr uint16_t curveLevel(unsigned int curve, unsigned int step) {
+  return (uint16_t)(FADE_LEVEL_MAX * (curve & CURVE_GAMMA
+    ? curveLightness(curveEase(curve & ~CURVE_GAMMA, step))
+    : curveEase(curve, step)) + 0.5);
+}
+
+template<unsigned int... Steps> struct curveSteps {};
+template<unsigned int N, unsigned int... Steps>
+struct makeCurveSteps : makeCurveSteps<N - 1, N - 1, Steps...> {};
+template<unsigned int... Steps>
+struct makeCurveSteps<0, Steps...> { typedef curveSteps<Steps...> type; };
+
+template<unsigned int... Steps>
+constexpr curveTable makeCurve(unsigned int curve, curveSteps<Steps...>) {
+  return {{ curveLevel(curve, Steps)... }};
+}
+
+constexpr curveTable makeCurve(unsigned int curve) {
+  return makeCurve(curve, makeCurveSteps<CURVE_STEPS>::type());
+}
+
+// Indexed by curve, then by curve | CURVE_GAMMA
+constexpr curveTable curveTables[CURVE_COUNT * 2] = {
+  makeCurve(CURVE_LINEAR), makeCurve(CURVE_EASE), makeCurve(CURVE_EXPONENTIAL),
+  makeCurve(CURVE_LINEAR | CURVE_GAMMA), makeCurve(CURVE_EASE | CURVE_GAMMA),
+  makeCurve(CURVE_EXPONENTIAL | CURVE_GAMMA)
+};
+
+constexpr bool curveRising(const curveTable &table, unsigned int step) {
+  return step >= CURVE_STEPS ||
+    (table.level[step - 1] <= table.level[step] && curveRising(table, step + 1));
+}
+
+constexpr bool curveValid(const curveTable &table) {
+  return table.level[0] == 0 && table.level[CURVE_STEPS - 1] == FADE_LEVEL_MAX &&
+    curveRising(table, 1);
+}
+
+static_assert(curveValid(curveTables[0]) && curveValid(curveTables[1]) &&
+  curveValid(curveTables[2]) && curveValid(curveTables[3]) &&
+  curveValid(curveTables[4]) && curveValid(curveTables[5]),
+  "fade curves must rise from off to full");
+
+// Golden levels at steps 1, 64, 128 and 192 of each curve
+static_assert(curveTables[0].level[1] == 257 && curveTables[0].level[64] == 16448 &&
+  curveTables[0].level[128] == 32896 && curveTables[0].level[192] == 49344,
+  "linear curve changed");
+static_assert(curveTables[1].level[1] == 3 && curveTables[1].level[64] == 10312 &&
+  curveTables[1].level[128] == 32960 && curveTables[1].level[192] == 55511,
+  "ease curve changed");
+static_assert(curveTables[2].level[1] == 2 && curveTables[2].level[64] == 301 &&
+  curveTables[2].level[128] == 2014 && curveTables[2].level[192] == 11771,
+  "exponential curve changed");
+static_assert(curveTables[3].level[1] == 28 && curveTables[3].level[64] == 2914 &&
+  curveTables[3].level[128] == 12179 && curveTables[3].level[192] == 31947,
+  "linear gamma curve changed");
+static_assert(curveTables[4].level[1] == 0 && curveTables[4].level[64] == 1342 &&
+  curveTables[4].level[128] == 12233 && curveTables[4].level[192] == 42879,
+  "ease gamma curve changed");
+static_assert(curveTables[5].level[1] == 0 && curveTables[5].level[64] == 33 &&
+  curveTables[5].level[128] == 223 && curveTables[5].level[192] == 1645,
+  "exponential gamma curve changed");
 
 
 // =-------------------------------------------------= EEPROM Configuration =--=
+#define SCREEN_EEPROM_VERSION 0x4D4D0002 // Bump when screenEEPROM changes
+
+// Profile flags, which optional screenConfig fields are set
+#define PROFILE_COLOR 0x01
+#define PROFILE_BRIGHTNESS 0x02
+#define PROFILE_FADE 0x04
+#define PROFILE_CURVE 0x08
+
 struct screenConfig {
   uint32_t id;
   unsigned short int indicator;
+  unsigned short int fade;  // Fade duration in msec, with PROFILE_FADE
+  byte color;               // Wheel position, with PROFILE_COLOR
+  byte brightness;          // Indicator brightness, with PROFILE_BRIGHTNESS
+  byte profile;             // PROFILE_* flags
+  byte curve;               // CURVE_* with CURVE_GAMMA, with PROFILE_CURVE
 };
 
 struct screenEEPROM {
+  uint32_t version;
   size_t count;
   screenConfig screens[SCREEN_COUNT];
+};
+
+// Layout written before profiles, migrated on load
+struct screenEEPROMv1 {
+  size_t count;
+  struct {
+    uint32_t id;
+    unsigned short int indicator;
+  } screens[SCREEN_COUNT];
   byte brightness;
 };
 
@@ -62,44 +559,248 @@ union {
     char eeArray[sizeof(screenEEPROM)];
 } EEPROMData;
 
+static_assert(SCREEN_EEPROM_ADDRESS + sizeof(screenEEPROM) <= SEGMENT_EEPROM_ADDRESS,
+  "screen registry overlaps the segment table");
+
+// Pixels lit by each indicator, either `count` pixels from `start` or, when
+// `mask` is set, pixel start + n for every set bit n
+#define SEGMENT_EEPROM_VERSION 0x53470001 // Bump when segmentEEPROM changes
+
+struct segmentConfig {
+  unsigned short int start;
+  unsigned short int count;
+  uint32_t mask;
+};
+
+struct segmentEEPROM {
+  uint32_t version;
+  segmentConfig segments[INDICATOR_COUNT];
+};
+
+static_assert(SEGMENT_EEPROM_ADDRESS + sizeof(segmentEEPROM) <= ACTIVE_EEPROM_ADDRESS,
+  "segment table overlaps the active indicator record");
+
+segmentConfig segments[INDICATOR_COUNT];
+
+// The active indicators are appended to a ring of small slots so boot can
+// show them before anything else. Each write goes to the next slot with the
+// next sequence number, the newest slot is the one its successor does not
+// follow.
+struct activeRecord {
+  uint32_t indicators; // Bitset of active indicators
+  byte sequence;       // Increments by one for every slot written
+  byte check;          // Bytes of indicators ^ sequence ^ ACTIVE_RECORD_MAGIC
+  uint16_t reserved;
+};
+
+static_assert(INDICATOR_COUNT <= 32, "active indicators are stored as a 32-bit set");
+static_assert(ACTIVE_EEPROM_ADDRESS + ACTIVE_RING_SLOTS * sizeof(activeRecord) <= ANIMATION_EEPROM_ADDRESS,
+  "active indicator ring overlaps the animation programs");
+
+uint32_t savedIndicators = 0;      // Indicators in the newest slot
+int activeSlot = -1;               // Newest slot, -1 when the ring is empty
+byte activeSequence = 0;           // Sequence number of the newest slot
+bool activeDirty = false;          // activeIndicators differs from the ring
+unsigned long activeChangedTime = 0; // millis() of the last indicator change
+
+// Animation programs uploaded with `animation`, validated before they are
+// stored so the VM can trust them
+#define ANIMATION_EEPROM_VERSION 0x414E0001 // Bump when animationEEPROM changes
+
+struct animationEEPROM {
+  uint32_t version;
+  byte length[ANIMATION_COUNT];
+  byte code[ANIMATION_COUNT][ANIMATION_SIZE];
+};
+
+static_assert(ANIMATION_EEPROM_ADDRESS + sizeof(animationEEPROM) <= ALIAS_EEPROM_ADDRESS,
+  "animation programs overlap the aliases");
+
+// Names for display ids, `set three` instead of `set 3`. Names are packed
+// back to back with their terminators in one arena, the n-th name belongs to
+// ids[n]; the same layout is stored in EEPROM.
+#define ALIAS_EEPROM_VERSION 0x414C0001 // Bump when aliasEEPROM changes
+
+struct aliasEEPROM {
+  uint32_t version;
+  byte count;                   // Names in the arena
+  byte reserved;
+  uint16_t used;                // Arena bytes in use
+  uint32_t ids[ALIAS_COUNT];
+  char arena[ALIAS_ARENA_SIZE];
+};
+
+static_assert(ALIAS_EEPROM_ADDRESS + sizeof(aliasEEPROM) <= 2047,
+  "aliases do not fit in EEPROM");
+static_assert(ALIAS_ARENA_SIZE <= 256, "alias offsets are stored in a byte");
+static_assert(ALIAS_SLOTS >= 2 * ALIAS_COUNT && (ALIAS_SLOTS & (ALIAS_SLOTS - 1)) == 0,
+  "alias index must be a power of 2 at least twice ALIAS_COUNT");
+
+aliasEEPROM aliases;
+byte aliasOffset[ALIAS_COUNT];  // Start of each name in the arena
+int8_t aliasSlots[ALIAS_SLOTS]; // Open addressed index of names, -1 when empty
+
+// Working copy of the screens, kept sorted by id for binary search. Readers
+// never lock: they take the published snapshot, which is never modified. A
+// writer copies it into the other buffer, changes the copy and publishes it
+// with one pointer store. Writers run one at a time, on loop().
+struct screenSnapshot {
+  screenConfig screens[SCREEN_COUNT];
+  size_t count;
+  uint64_t digest;  // Sum of screenHash() over the screens, kept up to date by every edit
+  uint32_t readers; // Readers holding this snapshot, it is not rebuilt until 0
+};
+
+screenSnapshot screenSnapshots[2];
+screenSnapshot *screenRegistry = &screenSnapshots[0]; // The published snapshot
+
+// Profile last selected for each indicator in the selection mailbox, copied
+// as the registry may change before the frame applies it
+screenConfig pendingProfile[INDICATOR_COUNT];
+
+// Registry and aliases when a replay started, put back when it reports so
+// replayed `add` and `remove` commands do not outlive it
+screenConfig replayScreens[SCREEN_COUNT];
+size_t replayScreenCount = 0;
+aliasEEPROM replayAliases;
+
 
 // =--------------------------------------------------= Function Prototypes =--=
-uint32_t Wheel(byte WheelPos, float brightness);
-byte scale(byte value, float percent);
-void setIndicatorByName(std::string name);
-void setIndicator(int indicator);
-void parseCommand(std::string command);
-std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems);
-std::vector<std::string> split(const std::string &s, char delim);
-std::string uintToString(uint32_t number);
-uint32_t stringToUint(std::string value);
+uint32_t Wheel(byte WheelPos, byte brightness);
+byte scale(byte value, byte brightness);
+uint32_t scaleColor(uint32_t color, uint16_t level);
+void applyProfile(const screenConfig &screen);
+bool parseProfile(char **params, int count, screenConfig &screen);
+bool parseCurve(const char *text, byte &curve);
+int findDisplay(const screenSnapshot *view, const char *name);
+bool selectDisplays(char **params, int count, int mode);
+void setIndicators(uint32_t indicators);
+void queueSelection(uint32_t indicators);
+void applySelection();
+void parseCommand(char *command);
+void runCommand(char **tokens, int count);
+commandRecord *commandSlot(commandQueue &queue);
+void pushCommand(commandQueue &queue);
+bool drainCommands(commandQueue &queue);
+int queueCloudCommand(const char *command, const String &input);
+int split(char *s, char delim, char **tokens, int maxTokens);
+void reply(const char *line);
+void replyf(const char *format, ...);
+bool replyReady();
+void startListing(listingLine next, uint32_t first, uint32_t last);
+void flushReplies();
+bool parseUint(const char *text, uint32_t &value);
+const screenSnapshot *readScreens();
+void releaseScreens(const screenSnapshot *view);
+screenSnapshot *editScreens();
+void publishScreens(screenSnapshot *edit);
+int findScreen(const screenSnapshot *view, uint32_t id);
+bool storeScreen(screenSnapshot *edit, const screenConfig &screen);
+uint64_t screenHash(const screenConfig &screen);
+bool reportDigest();
 void loadScreens();
+void migrateScreens();
 void updateScreens();
 void readEEPROM(void);
 void writeEEPROM(void);
+uint32_t loadActiveIndicators();
+void saveActiveIndicators(uint32_t indicators);
+byte activeCheck(const activeRecord &record);
 int call_addScreen(String input);
 int call_removeScreen(String input);
+String call_digest();
 bool listScreens();
-bool addScreen(std::vector<std::string> parsed);
-bool removeScreen(std::vector<std::string> parsed);
-void updateLEDs(unsigned long time_diff);
+bool listLine(uint32_t position);
+bool addScreen(char **params, int count);
+bool removeScreen(char **params, int count);
+void updateLEDs();
+void planFade();
+void endFadePlan();
+uint16_t plannedLevel(int indicator, int frames);
+void renderLEDs();
+void renderSegment(int indicator, uint16_t level);
+void showFrame();
+bool setSegment(char **params, int count);
+bool validSegment(const segmentConfig &segment);
+void loadSegments();
+void trace(byte id, uint32_t arg);
+bool dumpTrace();
+bool traceLine(uint32_t position);
+void recordLatency(latencySamples &latency, uint32_t sample);
+uint32_t latencyPercentile(const latencySamples &latency, unsigned int percentile);
+bool reportLatency();
+bool latencyLine(uint32_t position);
+bool reportStats();
+bool statsLine(uint32_t position);
+void captureCommand(char **tokens, int count);
+bool dumpCapture();
+bool captureLine(uint32_t position);
+bool startReplay(char **params, int count);
+void serviceReplay();
+void endReplay();
+uint32_t restoreProfiles(uint32_t indicators);
+uint32_t checksum(uint32_t hash, const uint8_t *data, size_t length);
+bool reportHeap();
+bool heapLine(uint32_t position);
+bool setAnimation(char **params, int count);
+bool playAnimation(char **params, int count);
+bool stepAnimation();
+void fillAnimation();
+void endAnimation();
+bool validAnimation(const byte *code, int length);
+int parseHex(const char *text, byte *data, int maxLength);
+bool startStream();
+void endStream();
+void readStream();
+void startStreamFrame();
+void readStreamRun(byte c);
+void finishStreamFrame();
+void dropStreamFrame(const char *error);
+bool setAlias(char **params, int count);
+int findAlias(const char *name);
+void removeAlias(int alias);
+bool removeAliases(uint32_t id);
+bool validAlias(const char *name);
+void indexAliases();
+void loadAliases();
+void saveAliases();
 
 
 // =-------------------------------------------------------= Core Functions =--=
 void setup() {
+  setupStartTime = micros();
+
   // Start Serial
   Serial.begin(9600);
 
   // Setup Particle cloud functions
   Particle.function("addScreen", call_addScreen);
   Particle.function("removeScreen", call_removeScreen);
+  Particle.variable("digest", call_digest);
 
-  // Start NeoPixel Set
+  // Start NeoPixel Set, showing the last active indicator straight away. This
+  // also clears any LEDs left lit across a reset.
   strip.begin();
-  setIndicator(-1); // Initialize all pixels to 'off'
-
-  // Load screens
+  strip.setTiming(PIXEL_TIMING);
+  strip.setPowerBudget(POWER_BUDGET_MA, POWER_CHANNEL_MA, POWER_IDLE_MA);
+  screenConfig defaults = {};
+  for (int i = 0; i < INDICATOR_COUNT; i++) {
+    defaults.indicator = i;
+    applyProfile(defaults);
+  }
+  loadSegments();
   loadScreens();
+  loadAliases();
+
+  // Restore the active indicators with the profile of the first display on
+  // each, so the first frame already has their colors
+  uint32_t saved = loadActiveIndicators();
+  restoreProfiles(saved);
+  for (int i = 0; i < INDICATOR_COUNT; i++) {
+    if (saved & (1UL << i)) indicatorLevel[i] = FADE_LEVEL_MAX;
+  }
+  setIndicators(saved); // Already at full level, so nothing fades in
+  renderLEDs();
 }
 
 void loop() {
@@ -107,266 +808,1966 @@ void loop() {
 
   unsigned long fadeUpdateTimeDiff = millis() - fadeUpdateTimer;
   if (fadeUpdateTimeDiff > FADE_UPDATE_INTERVAL_MSEC) {
-    updateLEDs(fadeUpdateTimeDiff);
+    if (fadeUpdateTimeDiff > frameIntervalMax) frameIntervalMax = fadeUpdateTimeDiff;
+    updateLEDs();
     fadeUpdateTimer = millis();
   }
+
+  // Run queued commands between frames, serial first as it has the user waiting
+  drainCommands(serialQueue);
+  drainCommands(cloudQueue);
+
+  if (replayActive) serviceReplay();
+
+  // Hand queued replies to Serial as far as it takes them, never waiting
+  flushReplies();
+
+  // Store the active indicators once settled, not on every focus change
+  if (activeDirty && millis() - activeChangedTime >= ACTIVE_PERSIST_DELAY_MSEC) {
+    saveActiveIndicators(activeIndicators);
+  }
 }
 
-void updateLEDs(unsigned long time_diff) {
-  // current indicator fades to full, all others fade out
-  float percent = (float)time_diff / (float)FADE_DURATION_MSEC;
-  bool needToWrite = false;
+void updateLEDs() {
+  applySelection();
+
+  // A streaming host owns the strip, the indicators come back when it ends
+  // or goes quiet
+  if (streamActive) {
+    if (millis() - streamLastFrame < STREAM_IDLE_MSEC) return;
+    endStream();
+  }
+
+  if (animationActive) {
+    unsigned long stepStart = micros();
+    bool changed = stepAnimation();
+    uint32_t stepTime = micros() - stepStart;
+    animationFrames++;
+    animationTimeSum += stepTime;
+    if (stepTime > animationTimeMax) animationTimeMax = stepTime;
 
-  for (int i = 0; i < PIXEL_COUNT; ++i) {
-    if (i == currentIndicator && indicatorBrightness[i] < 1) {
-      // fade up
-      indicatorBrightness[i] += percent;
-      if (indicatorBrightness[i] > 1) indicatorBrightness[i] = 1;
-      needToWrite = true;
-    } else if (i != currentIndicator && indicatorBrightness[i] > 0) {
-      // fade down
-      indicatorBrightness[i] -= percent;
-      if (indicatorBrightness[i] < 0) indicatorBrightness[i] = 0;
-      needToWrite = true;
+    trace(TRACE_FRAME_RENDERED, changed);
+    if (!animationActive) {
+      renderLEDs(); // Ended, bring the indicators back
+    } else if (changed) {
+      showFrame();
     }
-    strip.setPixelColor(i, Wheel(INDICATOR_COLOR, indicatorBrightness[i]));
+    return;
   }
 
+  // Transitions are pre-rendered by planFade(), a tick only copies the frame
+  // that is due into the strip. A late tick skips ahead so every fade keeps
+  // the duration of the profile it was lit with.
+  bool needToWrite = fadePlanShown + 1 < fadePlanFrames;
+  bool changed = false; // The frame differs from the one on display
+
   if (needToWrite) {
-    strip.setBrightness(INDICATOR_BRIGHTNESS);
-    strip.show();
+    int frame = (int)((millis() - fadePlanStart) / FADE_UPDATE_INTERVAL_MSEC) - 1;
+    if (frame <= fadePlanShown) frame = fadePlanShown + 1;
+    if (frame >= fadePlanFrames) frame = fadePlanFrames - 1;
+    changed = memcmp(fadePlan[frame], strip.getPixels(), PIXEL_BYTES) != 0;
+    strip.setPixels(fadePlan[frame], fadePlanSum[frame]);
+    fadePlanShown = frame;
   }
-}
 
-void serialEvent() {
-  char c = Serial.read();
-  // serialBuffer[serialCounter++] = c;
-  if (c != '\n') serialBuffer << c;
+  trace(TRACE_FRAME_RENDERED, needToWrite);
 
-  if (c == '\n' || serialCounter + 1 == COMMAND_BUFFER_SIZE) {
-    // new line or full buffer, accept command
-    // serialBuffer[serialCounter] = 0; // truncate the string
-    parseCommand(serialBuffer.str());
+  if (needToWrite) {
+    showFrame();
+
+    // Only once the LEDs look different, an early frame of a slow curve can
+    // round to the same bytes
+    if (framePending && changed) {
+      recordLatency(frameLatency, micros() - latencyStartTime);
+      framePending = false;
+    }
+
+    // Out of frames, settle the levels and plan whatever is left of the fade.
+    // It keeps this plan's schedule, so a late tick still catches up when
+    // long strips plan only a few frames at a time.
+    if (fadePlanShown == fadePlanFrames - 1) {
+      unsigned long next = fadePlanStart + (unsigned long)fadePlanFrames * FADE_UPDATE_INTERVAL_MSEC;
+      planFade();
+      if ((long)(millis() - next) > 0) fadePlanStart = next;
+    }
+  }
 
-    // reset buffer and counter
-    serialCounter = 0;
-    serialBuffer.str("");
-    serialBuffer.clear(); // Clear state flags.
+  if (fadePending && !fadingIndicators) {
+    recordLatency(fadeLatency, micros() - latencyStartTime);
+    framePending = false;
+    fadePending = false;
   }
 }
 
+// Render the frames fading every indicator in fadingIndicators toward its
+// target, starting from the frame on display. Frames are spaced one tick
+// apart; a fade longer than FADE_PLAN_FRAMES is planned in pieces.
+void planFade() {
+  endFadePlan();
 
-// =---------------------------------------------------= Command Processing =--=
-void parseCommand(std::string input) {
-  std::vector<std::string> parsed = split(input, ' ');
-  // Uncomment to print parsed command
-  // for (unsigned i = 0; i < parsed.size(); i++) {
-  //   Serial.println(parsed.at(i).c_str());
-  // }
+  int frames = 0;
+  for (uint32_t pending = fadingIndicators; pending; pending &= pending - 1) {
+    int i = __builtin_ctz(pending);
+    uint32_t distance = activeIndicators & (1UL << i)
+      ? FADE_LEVEL_MAX - indicatorLevel[i] : indicatorLevel[i];
+    if (distance == 0) {
+      fadingIndicators &= ~(1UL << i);
+      continue;
+    }
+    restyledIndicators &= ~(1UL << i); // Redrawn by the fade anyway
 
-  std::string command = parsed.at(0);
-  parsed.erase(parsed.begin());
+    uint32_t step = indicatorFade[i] > 0
+      ? (uint32_t)FADE_UPDATE_INTERVAL_MSEC * FADE_LEVEL_MAX / indicatorFade[i]
+      : FADE_LEVEL_MAX;
+    if (step == 0) step = 1;
+    fadePlanLevel[i] = indicatorLevel[i];
+    fadePlanStep[i] = step;
 
-  if (command.compare("set") == 0) {
-    setIndicatorByName(parsed.at(0));
-  } else if (command.compare("list") == 0) {
-    listScreens();
-  } else if (command.compare("add") == 0) {
-    addScreen(parsed);
-  } else if (command.compare("remove") == 0) {
-    removeScreen(parsed);
-  } else {
-    Serial.println("ERROR: Unknown command");
+    int needed = (distance + step - 1) / step;
+    if (needed > frames) frames = needed;
   }
-}
+  // A lit indicator with a new color or curve is redrawn at its level in the
+  // first frame, holding that level through the rest of the plan
+  uint32_t restyled = restyledIndicators & ~fadingIndicators;
+  restyledIndicators = 0;
+  for (uint32_t pending = restyled; pending; pending &= pending - 1) {
+    int i = __builtin_ctz(pending);
+    if (indicatorLevel[i] == 0) {
+      restyled &= ~(1UL << i); // Dark, nothing to redraw
+      continue;
+    }
+    fadePlanLevel[i] = indicatorLevel[i];
+    fadePlanStep[i] = 0;
+  }
+  if (frames == 0 && restyled) frames = 1;
 
-bool listScreens() {
-  Serial.println("OK");
+  if (frames == 0) return;
+  if (frames > FADE_PLAN_FRAMES) frames = FADE_PLAN_FRAMES;
 
-  for (
-    auto screen = screenMap.begin();
-    screen != screenMap.end();
-    screen++
-  ) {
-    Serial.printlnf("SCREEN: %s (%i)", screen->first.c_str(), screen->second);
+  fadePlanActive = activeIndicators;
+  fadePlanFading = fadingIndicators | restyled;
+
+  // The strip buffer always holds the frame on display, draw each planned
+  // frame over it. The frame on display waits in the last slot of the plan
+  // and is swapped back with the last frame, so it needs no stack copy.
+  uint8_t *pixels = strip.getPixels();
+  uint8_t *last = fadePlan[frames - 1];
+  uint32_t shownSum = strip.getLevelSum();
+  memcpy(last, pixels, PIXEL_BYTES);
+  for (int frame = 0; frame < frames; frame++) {
+    for (uint32_t pending = fadePlanFading; pending; pending &= pending - 1) {
+      int i = __builtin_ctz(pending);
+      renderSegment(i, plannedLevel(i, frame + 1));
+    }
+    if (frame < frames - 1) memcpy(fadePlan[frame], pixels, PIXEL_BYTES);
+    fadePlanSum[frame] = strip.getLevelSum();
   }
+  for (int i = 0; i < PIXEL_BYTES; i++) {
+    uint8_t byte = last[i];
+    last[i] = pixels[i];
+    pixels[i] = byte;
+  }
+  strip.setLevelSum(shownSum);
 
-  return true;
+  fadePlanFrames = frames;
+  fadePlanShown = -1;
+  fadePlanStart = millis();
 }
 
-bool addScreen(std::vector<std::string> parsed) {
-  if (parsed.size() < 2) {
-    Serial.println("ERROR: Insufficient parameters");
-    return false;
+// Bring indicatorLevel up to the last frame shown and drop the rest of the
+// plan, so a new transition starts from what is actually on the strip
+void endFadePlan() {
+  if (fadePlanShown >= 0) {
+    for (uint32_t pending = fadePlanFading; pending; pending &= pending - 1) {
+      int i = __builtin_ctz(pending);
+      indicatorLevel[i] = plannedLevel(i, fadePlanShown + 1);
+    }
+  } else if (fadePlanFrames > 0) {
+    restyledIndicators |= fadePlanFading; // Never drawn, the next plan redraws them
   }
+  fadePlanFrames = 0;
+  fadePlanShown = -1;
+}
 
-  screenMap[parsed.at(0)] = (int)stringToUint(parsed.at(1)); // update map
-  updateScreens();
+// Level of a fading indicator after some frames of the current plan
+uint16_t plannedLevel(int indicator, int frames) {
+  uint16_t level = fadePlanLevel[indicator];
+  uint32_t distance = fadePlanStep[indicator] * frames;
+  if (fadePlanActive & (1UL << indicator)) {
+    return distance < (uint32_t)(FADE_LEVEL_MAX - level) ? level + distance : FADE_LEVEL_MAX;
+  }
+  return distance < level ? level - distance : 0;
+}
 
-  Serial.println("OK");
-  return true;
+// Redraw every segment from scratch and show the frame, a fade in progress
+// carries on from it
+void renderLEDs() {
+  endFadePlan();
+  strip.clear();
+  for (int i = 0; i < INDICATOR_COUNT; ++i) {
+    if (indicatorLevel[i] > 0) renderSegment(i, indicatorLevel[i]);
+  }
+  restyledIndicators = 0;
+  showFrame();
+  planFade();
 }
 
-bool removeScreen(std::vector<std::string> parsed) {
-  if (parsed.size() < 1) {
-    Serial.println("ERROR: Insufficient parameters");
-    return false;
+// Fill the pixels of one segment with its indicator's color at a level, a
+// masked segment is filled one run of set bits at a time
+void renderSegment(int indicator, uint16_t level) {
+  segmentConfig &segment = segments[indicator];
+  byte curve = indicatorCurve[indicator];
+  const curveTable &table = curveTables[(curve & ~CURVE_GAMMA) + (curve & CURVE_GAMMA ? CURVE_COUNT : 0)];
+  uint32_t color = scaleColor(indicatorColor[indicator], table.level[level >> 8]);
+
+  if (segment.mask == 0) {
+    if (segment.count > 0) strip.fill(color, segment.start, segment.count);
+    return;
   }
 
-  screenMap.erase(parsed.at(0)); // update map
-  updateScreens();
+  uint32_t mask = segment.mask;
+  while (mask) {
+    int first = __builtin_ctz(mask);
+    uint32_t clear = ~(mask >> first);
+    int run = clear ? __builtin_ctz(clear) : 32 - first; // length of the run of set bits
+    strip.fill(color, segment.start + first, run);
+    mask &= run < 32 ? ~(((1UL << run) - 1) << first) : 0;
+  }
+}
 
-  Serial.println("OK");
-  return true;
+// Write the pixel buffer out to the strip and account for the frame
+void showFrame() {
+  unsigned long showStart = micros();
+  strip.show();
+  trace(TRACE_SHOW_COMPLETE, micros() - showStart);
+
+  uint32_t wireTime = strip.getShowTime();
+  frameChecksum = checksum(frameChecksum, strip.getPixels(), PIXEL_BYTES);
+  if (replayActive) replayChecksum = checksum(replayChecksum, strip.getPixels(), PIXEL_BYTES);
+  if (framesShown++ == 0) firstFrameTime = micros() - setupStartTime;
+  wireTimeSum += wireTime;
+  if (wireTime > wireTimeMax) wireTimeMax = wireTime;
 }
 
-void setIndicatorByName(std::string name) {
-  auto search = screenMap.find(name);
+// Run the playing program for one frame, returns whether any pixel changed.
+// Stops after ANIMATION_CYCLES_PER_FRAME instructions so a busy loop cannot
+// hold up the frame tick; the program carries on next frame.
+bool stepAnimation() {
+  animationState &a = animation;
 
-  if (search == screenMap.end()) {
-    setIndicator(-1);
-    Serial.println("ERROR: Unknown screen");
-  } else {
-    setIndicator(search->second);
-    Serial.println("OK");
+  if (a.wait > 0) {
+    a.wait--;
+    return false;
+  }
+  if (a.rampFrames > 0) {
+    a.rampFrame++;
+    a.level = a.rampFrom + ((int)a.rampTo - a.rampFrom) * a.rampFrame / a.rampFrames;
+    if (a.rampFrame == a.rampFrames) a.rampFrames = 0;
+    fillAnimation();
+    return true;
   }
-}
 
-void setIndicator(int indicator) {
-  currentIndicator = indicator;
-}
+  bool changed = false;
+  for (int cycles = 0; cycles < ANIMATION_CYCLES_PER_FRAME; cycles++) {
+    if (a.pc >= a.length) {
+      endAnimation();
+      return changed;
+    }
 
+    const byte *op = a.code + a.pc;
+    a.pc += animationOpLength[op[0]];
 
-// =-----------------------------------------------------= Helper Functions =--=
-std::string uintToString(uint32_t number) {
-  std::stringstream ss;
-  ss << number;
-  std::string str;
-  ss >> str;
-  return str;
-}
+    switch (op[0]) {
+      case OP_END:
+        endAnimation();
+        return changed;
+      case OP_COLOR:
+        a.color = strip.Color(op[1], op[2], op[3]);
+        break;
+      case OP_RANGE:
+        a.start = op[1] << 8 | op[2];
+        a.count = op[3] << 8 | op[4];
+        break;
+      case OP_FILL:
+        a.level = op[1];
+        fillAnimation();
+        changed = true;
+        break;
+      case OP_RAMP:
+        a.rampFrom = a.level;
+        a.rampTo = op[1];
+        a.rampFrame = 0;
+        a.rampFrames = op[2];
+        if (a.rampFrames == 0) {
+          a.level = a.rampTo;
+          fillAnimation();
+          return true;
+        }
+        return stepAnimation() || changed;
+      case OP_WAIT:
+        a.wait = op[1];
+        return changed;
+      case OP_REPEAT:
+        a.loops[a.depth].start = a.pc;
+        a.loops[a.depth].remaining = op[1];
+        a.depth++;
+        break;
+      case OP_NEXT: {
+        byte &remaining = a.loops[a.depth - 1].remaining;
+        if (remaining == 0 || --remaining > 0) {
+          a.pc = a.loops[a.depth - 1].start;
+        } else {
+          a.depth--;
+        }
+        break;
+      }
+      case OP_BLEND:
+        for (uint32_t i = a.start; i < a.start + (uint32_t)a.count && i < PIXEL_COUNT; i++) {
+          uint32_t pixel = strip.getPixelColor(i);
+          uint32_t blended = 0;
+          for (int shift = 0; shift < 24; shift += 8) {
+            int from = (pixel >> shift) & 0xFF;
+            int to = (a.color >> shift) & 0xFF;
+            blended |= (uint32_t)(from + (to - from) * op[1] / 256) << shift;
+          }
+          strip.setPixelColor(i, blended);
+        }
+        changed = true;
+        break;
+      case OP_MOVE:
+        a.start = (((int)a.start + (int8_t)op[1]) % PIXEL_COUNT + PIXEL_COUNT) % PIXEL_COUNT;
+        break;
+    }
+  }
 
-uint32_t stringToUint(std::string value) {
-  std::stringstream buffer(value);
-  long var;
-  buffer >> var;
-  return (uint32_t)var;
+  return changed;
 }
 
-// Kudos: http://stackoverflow.com/a/236803/772207
-std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
-  std::stringstream ss(s);
-  std::string item;
-  while (std::getline(ss, item, delim)) {
-    elems.push_back(item);
-  }
-  return elems;
+// Fill the range with the color register at the level register, clipped to
+// the strip
+void fillAnimation() {
+  animationState &a = animation;
+  if (a.start >= PIXEL_COUNT || a.count == 0) return;
+
+  uint16_t count = a.count < PIXEL_COUNT - a.start ? a.count : PIXEL_COUNT - a.start;
+  strip.fill(scaleColor(a.color, a.level * 257), a.start, count);
 }
 
-std::vector<std::string> split(const std::string &s, char delim) {
-  std::vector<std::string> elems;
-  split(s, delim, elems);
-  return elems;
+void endAnimation() {
+  animationActive = false;
 }
 
-// Input a value 0 to 255 to get a color value.
-// Brightness percent between 0 and 1
-// The colours are a transition r - g - b - back to r.
-uint32_t Wheel(byte WheelPos, float brightness) {
-  if (brightness == 0) {
-    return strip.Color(0, 0, 0);
+void serialEvent() {
+  if (streamActive) {
+    readStream();
+    return;
   }
 
-  if (WheelPos < 85) {
-    return strip.Color(
-      scale(WheelPos * 3, brightness),
-      scale(255 - WheelPos * 3, brightness),
-      scale(0, brightness)
-    );
-  } else if (WheelPos < 170) {
-    WheelPos -= 85;
-    return strip.Color(
-      scale(255 - WheelPos * 3, brightness),
-      scale(0, brightness),
-      scale(WheelPos * 3, brightness)
-    );
-  } else {
-    WheelPos -= 170;
-    return strip.Color(
-      scale(0, brightness),
-      scale(WheelPos * 3, brightness),
-      scale(255 - WheelPos * 3, brightness)
-    );
-  }
-}
+  // Read what has arrived straight into the next free queue record, bounded
+  // so a flood cannot starve the frame tick. With the queue full the bytes
+  // wait in the serial buffer until loop() catches up.
+  for (int n = 0; n < SERIAL_BYTES_PER_LOOP && Serial.available() > 0; n++) {
+    commandRecord *record = commandSlot(serialQueue);
+    if (!record) break;
 
-byte scale(byte value, float percent) {
-  return map(value, 0, 255, 0, (int)(percent * 255));
+    char c = Serial.read();
+    serialBytes++;
+    trace(TRACE_BYTE_RECEIVED, (byte)c);
+    if (serialCounter == 0) lineStartTime = micros();
+    if (c != '\n') record->line[serialCounter++] = c;
+
+    if (c == '\n' || serialCounter + 1 == COMMAND_BUFFER_SIZE) {
+      // new line or full buffer, accept command
+      if (c != '\n') serialOverflows++;
+      serialCommands++;
+      record->line[serialCounter] = 0; // terminate the string
+      record->count = split(record->line, ' ', record->tokens, COMMAND_MAX_TOKENS);
+      record->startTime = lineStartTime;
+      serialCounter = 0;
+      if (record->count > 0) pushCommand(serialQueue); // Ignore blank lines
+    }
+  }
 }
 
-// =--------------------------------------------= Config / EEPROM Functions =--=
-void loadScreens() {
-  readEEPROM();
+// Read frame bytes while streaming. A raw payload goes from Serial straight
+// into the strip buffer, nothing is set pixel by pixel.
+void readStream() {
+  uint8_t *pixels = strip.getPixels();
+  int budget = STREAM_BYTES_PER_LOOP;
 
-  if (EEPROMData.eevar.count > SCREEN_COUNT)
-    EEPROMData.eevar.count = SCREEN_COUNT;
+  while (streamActive && budget > 0 && Serial.available() > 0) {
+    if (streamHeaderCount > 0 && millis() - streamLastByte > STREAM_BYTE_TIMEOUT_MSEC) {
+      dropStreamFrame("ERROR: Frame timed out");
+    }
+    streamLastByte = millis();
 
-  for (unsigned int i = 0; i < EEPROMData.eevar.count; i++) {
-    screenConfig screen = EEPROMData.eevar.screens[i];
+    if (streamHeaderCount < STREAM_HEADER_SIZE) {
+      byte c = Serial.read();
+      budget--;
+      serialBytes++;
+      if (streamHeaderCount == 0 && c != STREAM_MAGIC) continue; // Resync on the next header
+      streamHeader[streamHeaderCount++] = c;
+      if (streamHeaderCount == STREAM_HEADER_SIZE) startStreamFrame();
+      continue;
+    }
 
-    // Only load valid data
-    if (screen.id > 0 && screen.indicator < PIXEL_COUNT) {
-      Serial.printlnf("screen: %i (%i)", screen.id, screen.indicator);
-      screenMap.insert(std::make_pair(uintToString(screen.id), screen.indicator));
+    if (streamEncoding == STREAM_RAW) {
+      int length = streamLength - streamReceived;
+      if (length > Serial.available()) length = Serial.available();
+      if (length > budget) length = budget;
+      uint8_t *start = pixels + streamReceived;
+      Serial.readBytes((char *)start, length);
+      streamHash = checksum(streamHash, start, length);
+      for (int i = 0; i < length; i++) streamLevel += start[i];
+      streamReceived += length;
+      streamOffset += length;
+      budget -= length;
+      serialBytes += length;
+    } else {
+      byte c = Serial.read();
+      budget--;
+      serialBytes++;
+      streamHash = checksum(streamHash, &c, 1);
+      streamReceived++;
+      readStreamRun(c);
     }
-  }
 
-  if (screenMap.size() != EEPROMData.eevar.count) {
-    Serial.println("ERROR: screen count and data do not match, rewriting");
-    updateScreens();
+    if (streamReceived == streamLength) finishStreamFrame();
   }
 }
 
-void updateScreens() {
-  // Iterate screenMap into eeprom struct
-  int index = 0;
-  for (
-    auto screen = screenMap.begin();
-    screen != screenMap.end();
-    screen++, index++
-  ) {
-    EEPROMData.eevar.screens[index].id = stringToUint(screen->first);
-    EEPROMData.eevar.screens[index].indicator = screen->second;
-  }
-  EEPROMData.eevar.count = screenMap.size() > SCREEN_COUNT ? SCREEN_COUNT : screenMap.size();
+// A full header has arrived, check it and get ready for the payload
+void startStreamFrame() {
+  const int stride = PIXEL_BYTES / PIXEL_COUNT;
+  streamEncoding = streamHeader[1];
+  streamLength = streamHeader[2] << 8 | streamHeader[3];
+  streamExpected = (uint32_t)streamHeader[4] << 24 | (uint32_t)streamHeader[5] << 16 |
+    (uint32_t)streamHeader[6] << 8 | streamHeader[7];
+  streamReceived = 0;
+  streamOffset = 0;
+  streamLevel = 0;
+  streamRunCount = 0;
+  streamHash = 2166136261UL;
 
-  writeEEPROM();
+  if (streamEncoding == STREAM_END) {
+    endStream();
+    reply("OK");
+    return;
+  }
+
+  bool valid = streamEncoding == STREAM_RAW
+    ? streamLength == PIXEL_BYTES
+    : streamEncoding == STREAM_RLE && streamLength > 0 && streamLength % (1 + stride) == 0;
+  if (!valid) dropStreamFrame("ERROR: Bad frame header");
 }
 
-void readEEPROM(void) {
-  for (int i = 0; i < sizeof(screenEEPROM); i++) {
-    EEPROMData.eeArray[i] = EEPROM.read(i);
+// Collect one RLE run, then copy its pixel across the run
+void readStreamRun(byte c) {
+  const int stride = PIXEL_BYTES / PIXEL_COUNT;
+  streamRun[streamRunCount++] = c;
+  if (streamRunCount < 1 + stride) return;
+  streamRunCount = 0;
+
+  int run = streamRun[0];
+  if (run == 0 || streamOffset + run * stride > PIXEL_BYTES) {
+    streamOffset = PIXEL_BYTES + 1; // Fails the size check at the end
+    return;
   }
+
+  uint8_t *pixels = strip.getPixels();
+  uint32_t level = 0;
+  for (int i = 0; i < stride; i++) level += streamRun[1 + i];
+  for (int i = 0; i < run; i++) {
+    memcpy(pixels + streamOffset, streamRun + 1, stride);
+    streamOffset += stride;
+  }
+  streamLevel += level * run;
 }
 
-void writeEEPROM(void) {
-  for (int i = 0; i < sizeof(screenEEPROM); i++) {
-    EEPROM.write(i, EEPROMData.eeArray[i]);
+// The payload is complete, show it if it arrived intact
+void finishStreamFrame() {
+  streamHeaderCount = 0;
+  if (streamHash != streamExpected) {
+    streamErrors++;
+    reply("ERROR: Frame checksum mismatch");
+    return;
+  }
+  if (streamOffset != PIXEL_BYTES) {
+    streamErrors++;
+    reply("ERROR: Frame size does not match the strip");
+    return;
   }
+
+  strip.setLevelSum(streamLevel);
+  showFrame();
+  streamFrames++;
+  streamLastFrame = millis();
+  reply("OK");
 }
 
+// Give up on the frame being read. Its partial payload stays in the strip
+// buffer unshown until the next frame overwrites it.
+void dropStreamFrame(const char *error) {
+  streamHeaderCount = 0;
+  streamErrors++;
+  reply(error);
+}
 
-// =---------------------------------------------= Particle Cloud Functions =--=
-int call_addScreen(String input) {
-  // input => screenId, indicator
-  std::string command = input.c_str();
-  std::vector<std::string> parsed = split(command, ' ');
-  return addScreen(parsed) ? 0 : -1;
+void endStream() {
+  streamActive = false;
+  streamHeaderCount = 0;
+  renderLEDs();
 }
 
-int call_removeScreen(String input) {
-  // input => screenId
-  std::string command = input.c_str();
-  std::vector<std::string> parsed = split(command, ' ');
-  return removeScreen(parsed) ? 0 : -1;
+
+// =---------------------------------------------------= Command Processing =--=
+// Tokenizes the command in place, `input` is modified
+void parseCommand(char *input) {
+  char *tokens[COMMAND_MAX_TOKENS];
+  int count = split(input, ' ', tokens, COMMAND_MAX_TOKENS);
+  if (count == 0) return; // Ignore blank lines
+
+  commandStartTime = micros();
+  runCommand(tokens, count);
+}
+
+// Record pointers for a producer to fill, NULL while the queue is full. The
+// slot stays the producer's until pushCommand() hands it over.
+commandRecord *commandSlot(commandQueue &queue) {
+  uint32_t head = queue.head;
+  if (head - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) == COMMAND_QUEUE_SIZE) return NULL;
+  return &queue.records[head % COMMAND_QUEUE_SIZE];
+}
+
+void pushCommand(commandQueue &queue) {
+  __atomic_store_n(&queue.head, queue.head + 1, __ATOMIC_RELEASE);
+}
+
+// Run every command queued so far, returns whether there were any
+bool drainCommands(commandQueue &queue) {
+  uint32_t head = __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE);
+  if (queue.tail == head) return false;
+
+  for (uint32_t tail = queue.tail; tail != head; tail++) {
+    // Leave the rest queued until their replies have room, a full queue
+    // holds the host back
+    if (!replyReady()) {
+      txStalls++;
+      break;
+    }
+
+    commandRecord &record = queue.records[tail % COMMAND_QUEUE_SIZE];
+    commandStartTime = record.startTime;
+    uint32_t allocStart = heapAllocs;
+    runCommand(record.tokens, record.count);
+    commandLines[lastCommandType]++;
+    commandAllocs[lastCommandType] += heapAllocs - allocStart;
+
+    // Hand the record back only once it is no longer read
+    __atomic_store_n(&queue.tail, tail + 1, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+// Dispatch a tokenized command, `count` includes the command itself
+void runCommand(char **tokens, int count) {
+  // Uncomment to print parsed command
+  // for (int i = 0; i < count; i++) {
+  //   reply(tokens[i]);
+  // }
+
+  // A leading `#<tag>` is echoed in front of the command's OK or ERROR, so a
+  // host can tell its replies from lines the device sends on its own. It is
+  // not one of the command's words. A tag too long to echo whole is refused,
+  // untagged, rather than echoed cut short.
+  replyTag[0] = 0;
+  lastCommandType = COMMAND_OTHER;
+  bool tagged = tokens[0][0] == '#';
+  bool tooMany = count - tagged > COMMAND_MAX_PARAMS + 1;
+  if (count > COMMAND_MAX_TOKENS) count = COMMAND_MAX_TOKENS;
+  if (tagged) {
+    if (strlen(tokens[0]) > REPLY_TAG_SIZE - 1) {
+      reply("ERROR: Tag too long");
+      return;
+    }
+    strcpy(replyTag, tokens[0]);
+    tokens++;
+    count--;
+    if (count == 0) {
+      reply("ERROR: Insufficient parameters");
+      replyTag[0] = 0;
+      return;
+    }
+  }
+  if (count > COMMAND_MAX_PARAMS + 1) count = COMMAND_MAX_PARAMS + 1;
+
+  const char *command = tokens[0];
+  char **params = tokens + 1;
+  count--;
+  trace(TRACE_COMMAND_PARSED, count);
+
+  for (int i = 0; i < COMMAND_OTHER; i++) {
+    if (strcmp(command, commandNames[i]) == 0) lastCommandType = i;
+  }
+
+  if (tooMany) {
+    reply("ERROR: Too many arguments");
+    replyTag[0] = 0;
+    return;
+  }
+
+  // Anything but another selection sees the selections before it applied
+  if (lastCommandType != COMMAND_SET && lastCommandType != COMMAND_SELECT &&
+      lastCommandType != COMMAND_DESELECT && lastCommandType != COMMAND_CLEAR) {
+    applySelection();
+  }
+
+  if (!replayActive && (
+    lastCommandType == COMMAND_SET ||
+    lastCommandType == COMMAND_SELECT ||
+    lastCommandType == COMMAND_DESELECT ||
+    lastCommandType == COMMAND_CLEAR ||
+    lastCommandType == COMMAND_ADD ||
+    lastCommandType == COMMAND_REMOVE
+  )) {
+    captureCommand(tokens, count + 1);
+  }
+
+  if (strcmp(command, "set") == 0) {
+    selectDisplays(params, count, COMMAND_SET);
+  } else if (strcmp(command, "select") == 0) {
+    selectDisplays(params, count, COMMAND_SELECT);
+  } else if (strcmp(command, "deselect") == 0) {
+    selectDisplays(params, count, COMMAND_DESELECT);
+  } else if (strcmp(command, "clear") == 0) {
+    selectDisplays(params, 0, COMMAND_CLEAR);
+  } else if (strcmp(command, "list") == 0) {
+    listScreens();
+  } else if (strcmp(command, "add") == 0) {
+    addScreen(params, count);
+  } else if (strcmp(command, "remove") == 0) {
+    removeScreen(params, count);
+  } else if (strcmp(command, "trace") == 0) {
+    dumpTrace();
+  } else if (strcmp(command, "latency") == 0) {
+    reportLatency();
+  } else if (strcmp(command, "stats") == 0) {
+    reportStats();
+  } else if (strcmp(command, "capture") == 0) {
+    dumpCapture();
+  } else if (strcmp(command, "replay") == 0) {
+    startReplay(params, count);
+  } else if (strcmp(command, "heap") == 0) {
+    reportHeap();
+  } else if (strcmp(command, "digest") == 0) {
+    reportDigest();
+  } else if (strcmp(command, "alias") == 0) {
+    setAlias(params, count);
+  } else if (strcmp(command, "segment") == 0) {
+    setSegment(params, count);
+  } else if (strcmp(command, "animation") == 0) {
+    setAnimation(params, count);
+  } else if (strcmp(command, "play") == 0) {
+    playAnimation(params, count);
+  } else if (strcmp(command, "stream") == 0) {
+    startStream();
+  } else if (strcmp(command, "stop") == 0) {
+    if (animationActive) {
+      endAnimation();
+      renderLEDs();
+    }
+    reply("OK");
+  } else {
+    reply("ERROR: Unknown command");
+  }
+  replyTag[0] = 0;
+}
+
+bool listScreens() {
+  reply("OK");
+  startListing(listLine, 0, 0);
+  return true;
+}
+
+// Every screen as `SCREEN: ...`, then every alias as `ALIAS: <name> <id>`.
+// Nothing edits the registry while a listing is written.
+bool listLine(uint32_t position) {
+  const screenSnapshot *view = readScreens();
+  size_t count = view->count;
+  if (position < count) {
+    const screenConfig &screen = view->screens[position];
+    byte curve = screen.profile & PROFILE_CURVE ? screen.curve : CURVE_LINEAR;
+    replyf("SCREEN: %lu (%u) color %d brightness %d fade %d curve %s%s",
+      screen.id, screen.indicator,
+      screen.profile & PROFILE_COLOR ? screen.color : -1,
+      screen.profile & PROFILE_BRIGHTNESS ? screen.brightness : -1,
+      screen.profile & PROFILE_FADE ? screen.fade : -1,
+      curveNames[curve & ~CURVE_GAMMA], curve & CURVE_GAMMA ? "+gamma" : "");
+  }
+  releaseScreens(view);
+  if (position < count) return true;
+
+  uint32_t alias = position - count;
+  if (alias >= aliases.count) return false;
+  replyf("ALIAS: %s %lu", aliases.arena + aliasOffset[alias], aliases.ids[alias]);
+  return true;
+}
+
+bool addScreen(char **params, int count) {
+  if (count < 2) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  uint32_t id, indicator;
+  screenConfig screen = {};
+  if (!parseUint(params[0], id) || !parseUint(params[1], indicator) ||
+      id == 0 || indicator >= INDICATOR_COUNT ||
+      !parseProfile(params + 2, count - 2, screen)) {
+    reply("ERROR: Invalid parameters");
+    return false;
+  }
+  screen.id = id;
+  screen.indicator = indicator;
+
+  screenSnapshot *edit = editScreens();
+  if (!storeScreen(edit, screen)) {
+    reply("ERROR: Screen memory full");
+    return false;
+  }
+  publishScreens(edit);
+  updateScreens();
+
+  // A display on show takes its new profile straight away
+  uint32_t bit = 1UL << screen.indicator;
+  if ((activeIndicators & bit) && indicatorScreen[screen.indicator] == screen.id) {
+    applyProfile(screen);
+    planFade();
+  }
+
+  reply("OK");
+  return true;
+}
+
+bool removeScreen(char **params, int count) {
+  if (count < 1) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  screenSnapshot *edit = editScreens();
+  int index = findDisplay(edit, params[0]);
+  if (index >= 0) {
+    uint32_t id = edit->screens[index].id;
+    edit->digest -= screenHash(edit->screens[index]);
+    edit->count--;
+    memmove(&edit->screens[index], &edit->screens[index + 1],
+      (edit->count - index) * sizeof(screenConfig));
+    publishScreens(edit);
+    updateScreens();
+    if (removeAliases(id)) saveAliases();
+  }
+
+  reply("OK");
+  return true;
+}
+
+// Report the registry digest, `DIGEST: <16 hex digits>`
+bool reportDigest() {
+  reply("OK");
+  const screenSnapshot *view = readScreens();
+  replyf("DIGEST: %08lx%08lx",
+    (unsigned long)(view->digest >> 32), (unsigned long)(uint32_t)view->digest);
+  releaseScreens(view);
+  return true;
+}
+
+// Index of a display by id or alias in a registry snapshot, or -1 when unknown
+int findDisplay(const screenSnapshot *view, const char *name) {
+  uint32_t id;
+  if (parseUint(name, id)) return findScreen(view, id);
+  int alias = findAlias(name);
+  return alias >= 0 ? findScreen(view, aliases.ids[alias]) : -1;
+}
+
+// Name a display, `alias <name> <display>`, or drop the name when no display
+// is given. A name is letters, digits, `-` and `_`, and not a number.
+bool setAlias(char **params, int count) {
+  if (count < 1) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  const char *name = params[0];
+  int alias = findAlias(name);
+  if (count == 1) {
+    if (alias >= 0) {
+      removeAlias(alias);
+      indexAliases();
+      saveAliases();
+    }
+    reply("OK");
+    return true;
+  }
+
+  uint32_t id;
+  if (!validAlias(name) || !parseUint(params[1], id)) {
+    reply("ERROR: Invalid parameters");
+    return false;
+  }
+  const screenSnapshot *view = readScreens();
+  bool known = findScreen(view, id) >= 0;
+  releaseScreens(view);
+  if (!known) {
+    reply("ERROR: Unknown screen");
+    return false;
+  }
+
+  if (alias >= 0) {
+    aliases.ids[alias] = id;
+  } else {
+    size_t length = strlen(name) + 1;
+    if (aliases.count == ALIAS_COUNT || aliases.used + length > ALIAS_ARENA_SIZE) {
+      reply("ERROR: Alias memory full");
+      return false;
+    }
+    memcpy(aliases.arena + aliases.used, name, length);
+    aliasOffset[aliases.count] = aliases.used;
+    aliases.ids[aliases.count] = id;
+    aliases.used += length;
+    aliases.count++;
+    indexAliases();
+  }
+  saveAliases();
+
+  reply("OK");
+  return true;
+}
+
+// Change the active set. `set` replaces it with the given displays, `select`
+// and `deselect` add and remove displays, `clear` empties it. An unknown
+// display leaves the active set as it was.
+bool selectDisplays(char **params, int count, int mode) {
+  if (count < 1 && mode != COMMAND_CLEAR) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  uint32_t current = selectionPending ? pendingIndicators : activeIndicators;
+  uint32_t indicators = 0;
+  int found[COMMAND_MAX_PARAMS];
+  const screenSnapshot *view = readScreens();
+  // Look every display up before queueing any profile, so an error leaves
+  // the pending selection untouched
+  for (int i = 0; i < count; i++) {
+    found[i] = findDisplay(view, params[i]);
+    if (found[i] < 0) {
+      releaseScreens(view);
+      reply("ERROR: Unknown screen");
+      return false;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    const screenConfig &screen = view->screens[found[i]];
+    uint32_t bit = 1UL << screen.indicator;
+    if (mode != COMMAND_DESELECT && !(indicators & bit)) {
+      pendingProfile[screen.indicator] = screen;
+      pendingProfiles |= bit;
+    }
+    indicators |= bit;
+  }
+  releaseScreens(view);
+
+  // Measure from the start of this command until the LEDs settle
+  latencyStartTime = commandStartTime;
+  framePending = true;
+  fadePending = true;
+
+  switch (mode) {
+    case COMMAND_SET: queueSelection(indicators); break;
+    case COMMAND_SELECT: queueSelection(current | indicators); break;
+    case COMMAND_DESELECT: queueSelection(current & ~indicators); break;
+    default: queueSelection(0); break;
+  }
+
+  reply("OK");
+  return true;
+}
+
+// Leave an active set in the mailbox, replacing one not applied yet
+void queueSelection(uint32_t indicators) {
+  selections++;
+  if (selectionPending) selectionsCoalesced++;
+  pendingIndicators = indicators;
+  selectionPending = true;
+  if (!SELECTION_MAILBOX) applySelection();
+}
+
+// Apply the mailbox, with the profile last selected for each indicator
+void applySelection() {
+  if (!selectionPending) return;
+  selectionPending = false;
+  selectionsApplied++;
+
+  for (uint32_t pending = pendingIndicators & pendingProfiles; pending; pending &= pending - 1) {
+    applyProfile(pendingProfile[__builtin_ctz(pending)]);
+  }
+  pendingProfiles = 0;
+  setIndicators(pendingIndicators);
+}
+
+// Any indicator entering or leaving the set starts fading
+void setIndicators(uint32_t indicators) {
+  endFadePlan();
+  fadingIndicators |= activeIndicators ^ indicators;
+  activeIndicators = indicators;
+  planFade();
+  trace(TRACE_INDICATOR_CHANGED, indicators);
+  activeDirty = true;
+  activeChangedTime = millis();
+}
+
+// Dump the trace ring oldest first, one `TRACE: <usec> <id> <arg>` per event
+bool dumpTrace() {
+  reply("OK");
+
+  uint32_t count = traceCount; // Snapshot, the dump itself records no events
+  startListing(traceLine, count > TRACE_SIZE ? count - TRACE_SIZE : 0, count);
+  return true;
+}
+
+// Events recorded while the dump is written may overwrite ones not written
+// yet, those are skipped
+bool traceLine(uint32_t position) {
+  uint32_t i = listing.first + position;
+  if (i >= listing.last) return false;
+  if (traceCount - i > TRACE_SIZE) return true;
+
+  traceEvent &event = traceRing[i % TRACE_SIZE];
+  replyf("TRACE: %lu %u %u", event.time, event.id, event.arg);
+  return true;
+}
+
+
+// Report p50/p99/max latency to the first changed frame and to fade completion
+bool reportLatency() {
+  reply("OK");
+  startListing(latencyLine, 0, 0);
+  return true;
+}
+
+bool latencyLine(uint32_t position) {
+  if (position > 1) return false;
+
+  const latencySamples &latency = position == 0 ? frameLatency : fadeLatency;
+  replyf("LATENCY: %s %lu p50 %lu p99 %lu max %lu",
+    position == 0 ? "frame" : "fade", latency.count,
+    latencyPercentile(latency, 50), latencyPercentile(latency, 99), latency.max);
+  return true;
+}
+
+// Report frame output counters and the wire time of the show() bitstream
+bool reportStats() {
+  reply("OK");
+  startListing(statsLine, 0, 0);
+  return true;
+}
+
+bool statsLine(uint32_t position) {
+  switch (position) {
+    case 0:
+      replyf("STATS: frames %lu interval max %lu", framesShown, frameIntervalMax);
+      return true;
+    case 1:
+      replyf("STATS: first frame %lu", firstFrameTime);
+      return true;
+    case 2:
+      replyf("STATS: serial bytes %lu commands %lu overflows %lu",
+        serialBytes, serialCommands, serialOverflows);
+      return true;
+    case 3:
+      replyf("STATS: cloud dropped %lu", cloudDropped);
+      return true;
+    case 4:
+      replyf("STATS: selections %lu coalesced %lu applied %lu", selections, selectionsCoalesced, selectionsApplied);
+      return true;
+    case 5:
+      replyf("STATS: checksum %08lx", frameChecksum);
+      return true;
+    case 6:
+      replyf("STATS: wire last %lu avg %lu max %lu",
+        strip.getShowTime(),
+        framesShown ? (uint32_t)(wireTimeSum / framesShown) : 0,
+        wireTimeMax);
+      return true;
+    case 7:
+      replyf("STATS: animation frames %lu avg %lu max %lu",
+        animationFrames,
+        animationFrames ? (uint32_t)(animationTimeSum / animationFrames) : 0,
+        animationTimeMax);
+      return true;
+    case 8:
+      replyf("STATS: stream frames %lu errors %lu", streamFrames, streamErrors);
+      return true;
+    case 9:
+      replyf("STATS: power estimate %lu budget %u scale %u",
+        strip.getPowerEstimate(), POWER_BUDGET_MA, strip.getPowerScale());
+      return true;
+    case 10:
+      replyf("STATS: tx bytes %lu max %lu stalls %lu dropped %lu",
+        txTail, txMax, txStalls, txDropped);
+      return true;
+  }
+  return false;
+}
+
+// Store a program, `animation <slot> [<hex bytecode>]`, no bytecode erases it
+bool setAnimation(char **params, int count) {
+  if (count < 1) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  uint32_t slot;
+  byte code[ANIMATION_SIZE];
+  int length = count > 1 ? parseHex(params[1], code, ANIMATION_SIZE) : 0;
+  if (!parseUint(params[0], slot) || slot >= ANIMATION_COUNT ||
+      length < 0 || !validAnimation(code, length)) {
+    reply("ERROR: Invalid parameters");
+    return false;
+  }
+  if (animationActive) {
+    endAnimation();
+    renderLEDs();
+  }
+
+  animationEEPROM stored;
+  EEPROM.get(ANIMATION_EEPROM_ADDRESS, stored);
+  if (stored.version != ANIMATION_EEPROM_VERSION) {
+    memset(&stored, 0, sizeof(stored));
+    stored.version = ANIMATION_EEPROM_VERSION;
+  }
+  stored.length[slot] = length;
+  memcpy(stored.code[slot], code, length);
+
+  unsigned long writeStart = micros();
+  EEPROM.put(ANIMATION_EEPROM_ADDRESS, stored);
+  trace(TRACE_EEPROM_WRITTEN, micros() - writeStart);
+
+  reply("OK");
+  return true;
+}
+
+// Start a stored program, `play <slot>`, from the frame on display
+bool playAnimation(char **params, int count) {
+  if (count < 1) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  uint32_t slot;
+  animationEEPROM stored;
+  EEPROM.get(ANIMATION_EEPROM_ADDRESS, stored);
+  if (!parseUint(params[0], slot) || slot >= ANIMATION_COUNT ||
+      stored.version != ANIMATION_EEPROM_VERSION || stored.length[slot] == 0 ||
+      !validAnimation(stored.code[slot], stored.length[slot])) {
+    reply("ERROR: Unknown animation");
+    return false;
+  }
+
+  memset(&animation, 0, sizeof(animation));
+  memcpy(animation.code, stored.code[slot], stored.length[slot]);
+  animation.length = stored.length[slot];
+  animation.color = strip.Color(255, 255, 255);
+  animation.count = PIXEL_COUNT;
+  animation.level = 255;
+  animationActive = true;
+
+  reply("OK");
+  return true;
+}
+
+// Hand the strip to the host, `stream`. The host sends frames once it has
+// read this OK; anything sent before it would be read as a command.
+bool startStream() {
+  if (animationActive) endAnimation();
+  streamActive = true;
+  streamHeaderCount = 0;
+  streamLastFrame = millis();
+  reply("OK");
+  return true;
+}
+
+// Dump captured commands oldest first as `CAPTURE: <msec since previous> <line>`
+bool dumpCapture() {
+  reply("OK");
+
+  uint32_t first = captureCount > CAPTURE_SIZE ? captureCount - CAPTURE_SIZE : 0;
+  startListing(captureLine, first, captureCount);
+  return true;
+}
+
+// Commands are only captured as they run, so the ring holds still while the
+// dump is written
+bool captureLine(uint32_t position) {
+  uint32_t i = listing.first + position;
+  if (i >= listing.last) return false;
+
+  capturedCommand &captured = captureRing[i % CAPTURE_SIZE];
+  uint32_t previous = position > 0 ? captureRing[(i - 1) % CAPTURE_SIZE].time : captured.time;
+  replyf("CAPTURE: %lu %s", captured.time - previous, captured.line);
+  return true;
+}
+
+// Feed the captured commands back through the parser, `replay fast` ignores
+// the captured timing. Capture is paused until the replay reports.
+bool startReplay(char **params, int count) {
+  if (replayActive) {
+    reply("ERROR: Replay in progress");
+    return false;
+  }
+
+  reply("OK");
+
+  // Keep what the replay may change, then start from a dark strip with the
+  // default profiles so the checksum only depends on the capture
+  const screenSnapshot *view = readScreens();
+  memcpy(replayScreens, view->screens, view->count * sizeof(screenConfig));
+  replayScreenCount = view->count;
+  releaseScreens(view);
+  replayAliases = aliases;
+  replayIndicators = activeIndicators;
+
+  if (animationActive) endAnimation();
+  screenConfig defaults = {};
+  for (int i = 0; i < INDICATOR_COUNT; i++) {
+    defaults.indicator = i;
+    applyProfile(defaults);
+    indicatorLevel[i] = 0;
+  }
+  fadingIndicators = 0;
+  setIndicators(0);
+  renderLEDs();
+
+  replayActive = true;
+  replayFast = count > 0 && strcmp(params[0], "fast") == 0;
+  replayEnd = captureCount;
+  replayNext = captureCount > CAPTURE_SIZE ? captureCount - CAPTURE_SIZE : 0;
+  replayStartTime = millis();
+  replayStartFrames = framesShown;
+  replayStartAllocs = heapAllocs;
+  replayCycles = 0;
+  replayChecksum = 2166136261UL;
+
+  return true;
+}
+
+void serviceReplay() {
+  uint32_t first = replayEnd > CAPTURE_SIZE ? replayEnd - CAPTURE_SIZE : 0;
+  uint32_t origin = captureRing[first % CAPTURE_SIZE].time;
+
+  while (replayNext < replayEnd) {
+    capturedCommand &captured = captureRing[replayNext % CAPTURE_SIZE];
+    if (!replayFast && millis() - replayStartTime < captured.time - origin) return;
+    if (!replyReady()) return;
+
+    char line[COMMAND_BUFFER_SIZE];
+    strcpy(line, captured.line); // parseCommand() tokenizes in place
+    uint32_t start = DWT->CYCCNT;
+    parseCommand(line);
+    replayCycles += DWT->CYCCNT - start;
+    replayNext++;
+  }
+
+  // Report once the last selection is shown and its fade has finished
+  if (selectionPending || fadingIndicators || fadePlanShown + 1 < fadePlanFrames) return;
+  if (!replyReady()) return;
+
+  uint32_t commands = replayEnd - first;
+  replyf("REPLAY: commands %lu usec %lu rate %lu allocs %lu frames %lu checksum %08lx",
+    commands, (uint32_t)(replayCycles / REPLAY_CYCLES_PER_USEC),
+    replayCycles ? (uint32_t)((uint64_t)commands * REPLAY_CYCLES_PER_USEC * 1000000 / replayCycles) : 0,
+    heapAllocs - replayStartAllocs, framesShown - replayStartFrames, replayChecksum);
+
+  endReplay();
+}
+
+// Put back the registry and aliases from before the replay, saving them
+// again if it changed them, and fade back to the active set it replaced
+void endReplay() {
+  replayActive = false;
+
+  const screenSnapshot *view = readScreens();
+  bool changed = view->count != replayScreenCount ||
+    memcmp(view->screens, replayScreens, replayScreenCount * sizeof(screenConfig)) != 0;
+  releaseScreens(view);
+  if (changed) {
+    screenSnapshot *edit = editScreens();
+    edit->count = 0;
+    edit->digest = 0;
+    for (unsigned int i = 0; i < replayScreenCount; i++) storeScreen(edit, replayScreens[i]);
+    publishScreens(edit);
+    updateScreens();
+  }
+
+  if (memcmp(&aliases, &replayAliases, sizeof(aliases)) != 0) {
+    aliases = replayAliases;
+    indexAliases();
+    saveAliases();
+  }
+
+  restoreProfiles(replayIndicators);
+  setIndicators(replayIndicators);
+}
+
+// Apply the profile of the first display on each of a set of indicators,
+// returns the indicators that have one
+uint32_t restoreProfiles(uint32_t indicators) {
+  uint32_t restored = 0;
+  const screenSnapshot *view = readScreens();
+  for (unsigned int i = 0; i < view->count; i++) {
+    uint32_t bit = 1UL << view->screens[i].indicator;
+    if ((indicators & bit) && !(restored & bit)) {
+      applyProfile(view->screens[i]);
+      restored |= bit;
+    }
+  }
+  releaseScreens(view);
+  return restored;
+}
+
+// Report allocator counters, free memory and allocations per serial command
+bool reportHeap() {
+  reply("OK");
+  startListing(heapLine, 0, 0);
+  return true;
+}
+
+bool heapLine(uint32_t position) {
+  if (position == 0) {
+    replyf("HEAP: live %lu peak %lu allocs %lu frees %lu",
+      heapLiveBytes, heapPeakBytes, heapAllocs, heapFrees);
+  } else if (position == 1) {
+    // Read from the allocator's own bookkeeping. Probing with malloc() would
+    // briefly take the heap the system thread allocates from.
+    struct mallinfo heap = mallinfo();
+    replyf("HEAP: free %lu blocks %u top %u",
+      System.freeMemory(), heap.ordblks, heap.keepcost);
+  } else if (position < 2 + COMMAND_TYPES) {
+    int i = position - 2;
+    replyf("HEAP: %s commands %lu allocs %lu",
+      commandNames[i], commandLines[i], commandAllocs[i]);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+// =--------------------------------------------------------= Serial Output =--=
+// Queue a reply line, dropped whole when the ring has no room for it. Commands
+// only run with room for a line, so this only drops when a host streaming
+// frames stops reading its replies.
+void reply(const char *line) {
+  char tagged[TX_LINE_MAX];
+  if (replyTag[0] && (strncmp(line, "OK", 2) == 0 || strncmp(line, "ERROR", 5) == 0)) {
+    snprintf(tagged, sizeof(tagged), "%s %s", replyTag, line);
+    line = tagged;
+  }
+
+  size_t length = strlen(line);
+  if (length > TX_LINE_MAX - 2) length = TX_LINE_MAX - 2;
+  if (TX_BUFFER_SIZE - (txHead - txTail) < length + 2) {
+    txDropped++;
+    return;
+  }
+
+  for (size_t i = 0; i < length; i++) txRing[(txHead + i) % TX_BUFFER_SIZE] = line[i];
+  txRing[(txHead + length) % TX_BUFFER_SIZE] = '\r';
+  txRing[(txHead + length + 1) % TX_BUFFER_SIZE] = '\n';
+  txHead += length + 2;
+  if (txHead - txTail > txMax) txMax = txHead - txTail;
+}
+
+void replyf(const char *format, ...) {
+  char line[TX_LINE_MAX - 1];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  reply(line);
+}
+
+// Whether a command may run: no listing is being written and its reply fits
+bool replyReady() {
+  return !listing.next && TX_BUFFER_SIZE - (txHead - txTail) >= TX_LINE_MAX;
+}
+
+// Write a reply longer than a line, `next` is called for line 0, 1, ...
+// from flushReplies() until it returns false
+void startListing(listingLine next, uint32_t first, uint32_t last) {
+  listing.next = next;
+  listing.position = 0;
+  listing.first = first;
+  listing.last = last;
+}
+
+// Continue the listing while the ring has room, then write as much of the
+// ring as the USB buffer takes without blocking
+void flushReplies() {
+  while (listing.next && TX_BUFFER_SIZE - (txHead - txTail) >= TX_LINE_MAX) {
+    if (!listing.next(listing.position++)) listing.next = NULL;
+  }
+
+  int room = Serial.availableForWrite();
+  while (txHead != txTail && room > 0) {
+    uint32_t start = txTail % TX_BUFFER_SIZE;
+    uint32_t length = txHead - txTail;
+    if (length > TX_BUFFER_SIZE - start) length = TX_BUFFER_SIZE - start;
+    if (length > (uint32_t)room) length = room;
+    Serial.write((const uint8_t *)txRing + start, length);
+    txTail += length;
+    room -= length;
+  }
+}
+
+
+// =-----------------------------------------------------= Helper Functions =--=
+
+// Every instruction must be known and complete, repeats nested no deeper
+// than ANIMATION_LOOP_DEPTH and matched by a next
+bool validAnimation(const byte *code, int length) {
+  if (length > ANIMATION_SIZE) return false;
+
+  int depth = 0;
+  for (int pc = 0; pc < length; pc += animationOpLength[code[pc]]) {
+    if (code[pc] >= OP_COUNT || pc + animationOpLength[code[pc]] > length) return false;
+    if (code[pc] == OP_REPEAT && ++depth > ANIMATION_LOOP_DEPTH) return false;
+    if (code[pc] == OP_NEXT && --depth < 0) return false;
+  }
+  return depth == 0;
+}
+
+// Decode pairs of hex digits, returns the number of bytes or -1 when invalid
+int parseHex(const char *text, byte *data, int maxLength) {
+  int length = 0;
+  for (; text[0] && text[1]; text += 2) {
+    char digits[5] = { '0', 'x', text[0], text[1], 0 };
+    uint32_t value;
+    if (length == maxLength || !parseUint(digits, value)) return -1;
+    data[length++] = value;
+  }
+  return text[0] ? -1 : length;
+}
+
+// Store a tokenized command, rejoined with single spaces
+void captureCommand(char **tokens, int count) {
+  capturedCommand &captured = captureRing[captureCount++ % CAPTURE_SIZE];
+  captured.time = millis();
+
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    length += snprintf(captured.line + length, COMMAND_BUFFER_SIZE - length,
+      i ? " %s" : "%s", tokens[i]);
+    if (length >= COMMAND_BUFFER_SIZE) break;
+  }
+}
+
+// FNV-1a, seeded with a previous hash so frames can be chained
+uint32_t checksum(uint32_t hash, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+void recordLatency(latencySamples &latency, uint32_t sample) {
+  latency.samples[latency.count++ % LATENCY_SAMPLES] = sample;
+  if (sample > latency.max) latency.max = sample;
+}
+
+// Nearest-rank percentile over the recent samples, sorted on a stack copy
+uint32_t latencyPercentile(const latencySamples &latency, unsigned int percentile) {
+  uint32_t sorted[LATENCY_SAMPLES];
+  unsigned int count = latency.count < LATENCY_SAMPLES ? latency.count : LATENCY_SAMPLES;
+  if (count == 0) return 0;
+
+  for (unsigned int i = 0; i < count; i++) {
+    uint32_t sample = latency.samples[i];
+    unsigned int j = i;
+    for (; j > 0 && sorted[j - 1] > sample; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = sample;
+  }
+
+  return sorted[(count * percentile + 99) / 100 - 1];
+}
+
+// Record an event in the trace ring, overwriting the oldest once full
+void trace(byte id, uint32_t arg) {
+  traceEvent &event = traceRing[traceCount++ % TRACE_SIZE];
+  event.time = micros();
+  event.arg = arg > 0xFFFF ? 0xFFFF : arg; // saturate durations
+  event.id = id;
+}
+
+// Parse an unsigned integer, decimal or hex with a 0x prefix. Fails on empty
+// input, anything other than digits, or a value that does not fit in 32 bits.
+bool parseUint(const char *text, uint32_t &value) {
+  uint32_t base = 10;
+  if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+    base = 16;
+    text += 2;
+  }
+  if (*text == 0) return false;
+
+  uint32_t result = 0;
+  for (; *text; text++) {
+    uint32_t digit;
+    if (*text >= '0' && *text <= '9') digit = *text - '0';
+    else if (base == 16 && *text >= 'a' && *text <= 'f') digit = *text - 'a' + 10;
+    else if (base == 16 && *text >= 'A' && *text <= 'F') digit = *text - 'A' + 10;
+    else return false;
+
+    if (result > (0xFFFFFFFFUL - digit) / base) return false; // overflow
+    result = result * base + digit;
+  }
+
+  value = result;
+  return true;
+}
+
+// Entry of an alias, or -1 when unknown. One hash and usually one compare,
+// probing the index from the name's hash.
+int findAlias(const char *name) {
+  uint32_t hash = checksum(2166136261UL, (const uint8_t *)name, strlen(name));
+  for (int probe = 0; probe < ALIAS_SLOTS; probe++) {
+    int alias = aliasSlots[(hash + probe) & (ALIAS_SLOTS - 1)];
+    if (alias < 0) return -1;
+    if (strcmp(aliases.arena + aliasOffset[alias], name) == 0) return alias;
+  }
+  return -1;
+}
+
+// Drop one name, closing its gap in the arena. The index needs rebuilding.
+void removeAlias(int alias) {
+  byte start = aliasOffset[alias];
+  byte length = strlen(aliases.arena + start) + 1;
+  memmove(aliases.arena + start, aliases.arena + start + length, aliases.used - start - length);
+  aliases.used -= length;
+
+  aliases.count--;
+  for (int i = alias; i < aliases.count; i++) {
+    aliases.ids[i] = aliases.ids[i + 1];
+    aliasOffset[i] = aliasOffset[i + 1] - length;
+  }
+}
+
+// Drop every name of a display, returns whether there were any
+bool removeAliases(uint32_t id) {
+  bool removed = false;
+  for (int i = aliases.count - 1; i >= 0; i--) {
+    if (aliases.ids[i] == id) {
+      removeAlias(i);
+      removed = true;
+    }
+  }
+  if (removed) indexAliases();
+  return removed;
+}
+
+bool validAlias(const char *name) {
+  uint32_t id;
+  size_t length = strlen(name);
+  if (length == 0 || length > ALIAS_NAME_MAX || parseUint(name, id)) return false;
+  for (const char *c = name; *c; c++) {
+    bool allowed = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+      (*c >= '0' && *c <= '9') || *c == '-' || *c == '_';
+    if (!allowed) return false;
+  }
+  return true;
+}
+
+// Rebuild the hash index over the arena
+void indexAliases() {
+  memset(aliasSlots, -1, sizeof(aliasSlots));
+  for (int i = 0; i < aliases.count; i++) {
+    const char *name = aliases.arena + aliasOffset[i];
+    uint32_t hash = checksum(2166136261UL, (const uint8_t *)name, strlen(name));
+    while (aliasSlots[hash & (ALIAS_SLOTS - 1)] >= 0) hash++;
+    aliasSlots[hash & (ALIAS_SLOTS - 1)] = i;
+  }
+}
+
+// Split `s` in place on `delim`, runs of delimiters count as one. Stores up
+// to `maxTokens` pointers into `s` and returns how many were found, which is
+// more than `maxTokens` when some did not fit.
+int split(char *s, char delim, char **tokens, int maxTokens) {
+  int count = 0;
+
+  while (*s) {
+    while (*s == delim) *s++ = 0;
+    if (*s == 0) break;
+
+    if (count < maxTokens) tokens[count] = s;
+    count++;
+    while (*s && *s != delim) s++;
+  }
+
+  return count;
+}
+
+// Binary search the sorted registry, returns the index or -1
+int findScreen(const screenSnapshot *view, uint32_t id) {
+  int low = 0;
+  int high = (int)view->count - 1;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (view->screens[mid].id == id) return mid;
+    if (view->screens[mid].id < id) low = mid + 1;
+    else high = mid - 1;
+  }
+
+  return -1;
+}
+
+// Insert or update a screen in a snapshot being edited, keeping it sorted.
+// False when full.
+bool storeScreen(screenSnapshot *edit, const screenConfig &screen) {
+  int index = findScreen(edit, screen.id);
+  if (index >= 0) {
+    edit->digest += screenHash(screen) - screenHash(edit->screens[index]);
+    edit->screens[index] = screen;
+    return true;
+  }
+
+  if (edit->count >= SCREEN_COUNT) return false;
+
+  unsigned int position = 0;
+  while (position < edit->count && edit->screens[position].id < screen.id) position++;
+  memmove(&edit->screens[position + 1], &edit->screens[position],
+    (edit->count - position) * sizeof(screenConfig));
+  edit->screens[position] = screen;
+  edit->count++;
+  edit->digest += screenHash(screen);
+
+  return true;
+}
+
+// Take the published registry snapshot. It stays intact until released,
+// however many changes are published meanwhile.
+//
+// The reader stores `readers` then loads `screenRegistry`, the writer stores
+// `screenRegistry` then loads `readers`. Acquire and release let both loads
+// see the old values, so the writer would rebuild a snapshot the reader goes
+// on to use; all four are seq_cst so at least one sees the other's store.
+const screenSnapshot *readScreens() {
+  for (;;) {
+    screenSnapshot *view = __atomic_load_n(&screenRegistry, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&view->readers, 1, __ATOMIC_SEQ_CST);
+    // A writer may have swapped it out and started rebuilding it before the
+    // count went up, then try the new one
+    if (view == __atomic_load_n(&screenRegistry, __ATOMIC_SEQ_CST)) return view;
+    __atomic_sub_fetch(&view->readers, 1, __ATOMIC_RELEASE);
+  }
+}
+
+void releaseScreens(const screenSnapshot *view) {
+  __atomic_sub_fetch(&((screenSnapshot *)view)->readers, 1, __ATOMIC_RELEASE);
+}
+
+// Start a change: a copy of the published snapshot in the other buffer, once
+// the last reader of that buffer's old contents has let go. Nothing sees the
+// copy until publishScreens(); dropping it unpublished abandons the change.
+screenSnapshot *editScreens() {
+  screenSnapshot *current = __atomic_load_n(&screenRegistry, __ATOMIC_ACQUIRE);
+  screenSnapshot *edit = current == &screenSnapshots[0] ? &screenSnapshots[1] : &screenSnapshots[0];
+  while (__atomic_load_n(&edit->readers, __ATOMIC_SEQ_CST) > 0) {}
+
+  memcpy(edit->screens, current->screens, current->count * sizeof(screenConfig));
+  edit->count = current->count;
+  edit->digest = current->digest;
+  return edit;
+}
+
+void publishScreens(screenSnapshot *edit) {
+  __atomic_store_n(&screenRegistry, edit, __ATOMIC_SEQ_CST);
+}
+
+// 64-bit FNV-1a of a screen's canonical bytes: id (4 bytes, big endian),
+// indicator, profile flags, then color, brightness, fade (2 bytes, big
+// endian) and curve for each flag set. The registry digest is the sum of
+// these, so an edit updates it in O(1) whatever the order of the screens.
+uint64_t screenHash(const screenConfig &screen) {
+  byte bytes[12];
+  int length = 0;
+  for (int shift = 24; shift >= 0; shift -= 8) bytes[length++] = screen.id >> shift;
+  bytes[length++] = screen.indicator;
+  bytes[length++] = screen.profile;
+  if (screen.profile & PROFILE_COLOR) bytes[length++] = screen.color;
+  if (screen.profile & PROFILE_BRIGHTNESS) bytes[length++] = screen.brightness;
+  if (screen.profile & PROFILE_FADE) {
+    bytes[length++] = screen.fade >> 8;
+    bytes[length++] = screen.fade;
+  }
+  if (screen.profile & PROFILE_CURVE) bytes[length++] = screen.curve;
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Optional `[<color> [<brightness> [<fade> [<curve>]]]]` after an add, `-`
+// keeps the default for that field
+bool parseProfile(char **params, int count, screenConfig &screen) {
+  uint32_t value;
+
+  if (count > 0 && strcmp(params[0], "-") != 0) {
+    if (!parseUint(params[0], value) || value > 255) return false;
+    screen.color = value;
+    screen.profile |= PROFILE_COLOR;
+  }
+  if (count > 1 && strcmp(params[1], "-") != 0) {
+    if (!parseUint(params[1], value) || value > 255) return false;
+    screen.brightness = value;
+    screen.profile |= PROFILE_BRIGHTNESS;
+  }
+  if (count > 2 && strcmp(params[2], "-") != 0) {
+    if (!parseUint(params[2], value) || value > 65535) return false;
+    screen.fade = value;
+    screen.profile |= PROFILE_FADE;
+  }
+  if (count > 3 && strcmp(params[3], "-") != 0) {
+    if (!parseCurve(params[3], screen.curve)) return false;
+    screen.profile |= PROFILE_CURVE;
+  }
+
+  return true;
+}
+
+// `<name>` or `<name>+gamma`, with a name from curveNames
+bool parseCurve(const char *text, byte &curve) {
+  const char *suffix = strchr(text, '+');
+  size_t length = suffix ? (size_t)(suffix - text) : strlen(text);
+  if (suffix && strcmp(suffix, "+gamma") != 0) return false;
+
+  for (int i = 0; i < CURVE_COUNT; i++) {
+    if (strlen(curveNames[i]) == length && strncmp(text, curveNames[i], length) == 0) {
+      curve = i | (suffix ? CURVE_GAMMA : 0);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Precompute the full level color and fade rate of a screen's indicator so
+// rendering only scales a stored color. An indicator drawn with a different
+// color or curve is marked to be redrawn by the next fade plan.
+void applyProfile(const screenConfig &screen) {
+  if (screen.indicator >= INDICATOR_COUNT) return;
+
+  uint32_t color = Wheel(
+    screen.profile & PROFILE_COLOR ? screen.color : INDICATOR_COLOR,
+    screen.profile & PROFILE_BRIGHTNESS ? screen.brightness : INDICATOR_BRIGHTNESS);
+  byte curve = screen.profile & PROFILE_CURVE ? screen.curve : CURVE_LINEAR;
+  if (color != indicatorColor[screen.indicator] || curve != indicatorCurve[screen.indicator]) {
+    restyledIndicators |= 1UL << screen.indicator;
+  }
+
+  indicatorColor[screen.indicator] = color;
+  indicatorFade[screen.indicator] =
+    screen.profile & PROFILE_FADE ? screen.fade : FADE_DURATION_MSEC;
+  indicatorCurve[screen.indicator] = curve;
+  indicatorScreen[screen.indicator] = screen.id;
+}
+
+// Input a value 0 to 255 to get a color value.
+// Brightness between 0 and 255, scaled like Adafruit_NeoPixel::setBrightness
+// The colours are a transition r - g - b - back to r.
+uint32_t Wheel(byte WheelPos, byte brightness) {
+  if (WheelPos < 85) {
+    return strip.Color(
+      scale(WheelPos * 3, brightness),
+      scale(255 - WheelPos * 3, brightness),
+      scale(0, brightness)
+    );
+  } else if (WheelPos < 170) {
+    WheelPos -= 85;
+    return strip.Color(
+      scale(255 - WheelPos * 3, brightness),
+      scale(0, brightness),
+      scale(WheelPos * 3, brightness)
+    );
+  } else {
+    WheelPos -= 170;
+    return strip.Color(
+      scale(0, brightness),
+      scale(WheelPos * 3, brightness),
+      scale(255 - WheelPos * 3, brightness)
+    );
+  }
+}
+
+byte scale(byte value, byte brightness) {
+  return (value * (brightness + 1)) >> 8;
+}
+
+// Scale each channel of a packed color by a fade level, FADE_LEVEL_MAX keeps
+// the color as is and 0 is off
+uint32_t scaleColor(uint32_t color, uint16_t level) {
+  uint32_t factor = (uint32_t)level + 1;
+  return ((((color >> 16) & 0xFF) * factor) >> 16) << 16 |
+         ((((color >> 8) & 0xFF) * factor) >> 16) << 8 |
+         (((color & 0xFF) * factor) >> 16);
+}
+
+// =--------------------------------------------= Config / EEPROM Functions =--=
+void loadScreens() {
+  readEEPROM();
+
+  bool migrated = EEPROMData.eevar.version != SCREEN_EEPROM_VERSION;
+  if (migrated) migrateScreens();
+
+  if (EEPROMData.eevar.count > SCREEN_COUNT)
+    EEPROMData.eevar.count = SCREEN_COUNT;
+
+  // The whole registry is built in one edit and published once
+  screenSnapshot *edit = editScreens();
+  edit->count = 0;
+  edit->digest = 0;
+  for (unsigned int i = 0; i < EEPROMData.eevar.count; i++) {
+    screenConfig screen = EEPROMData.eevar.screens[i];
+
+    // Only load valid data, use `list` to see what was loaded
+    if (screen.id > 0 && screen.indicator < INDICATOR_COUNT) {
+      if ((screen.curve & ~CURVE_GAMMA) >= CURVE_COUNT) screen.profile &= ~PROFILE_CURVE;
+      storeScreen(edit, screen);
+    }
+  }
+  publishScreens(edit);
+
+  if (edit->count != EEPROMData.eevar.count) {
+    reply("ERROR: screen count and data do not match, rewriting");
+    updateScreens();
+  } else if (migrated) {
+    updateScreens();
+  }
+}
+
+// Map an indicator to a segment, `segment <indicator> <start> <count> [<mask>]`
+bool setSegment(char **params, int count) {
+  if (count < 3) {
+    reply("ERROR: Insufficient parameters");
+    return false;
+  }
+
+  uint32_t indicator, start, length, mask = 0;
+  if (!parseUint(params[0], indicator) || !parseUint(params[1], start) ||
+      !parseUint(params[2], length) || (count > 3 && !parseUint(params[3], mask)) ||
+      indicator >= INDICATOR_COUNT || start > 0xFFFF || length > 0xFFFF) {
+    reply("ERROR: Invalid parameters");
+    return false;
+  }
+
+  segmentConfig segment = { (unsigned short)start, (unsigned short)(mask ? 0 : length), mask };
+  if (!validSegment(segment)) {
+    reply("ERROR: Invalid parameters");
+    return false;
+  }
+  segments[indicator] = segment;
+
+  segmentEEPROM stored;
+  stored.version = SEGMENT_EEPROM_VERSION;
+  memcpy(stored.segments, segments, sizeof(segments));
+  unsigned long writeStart = micros();
+  EEPROM.put(SEGMENT_EEPROM_ADDRESS, stored);
+  trace(TRACE_EEPROM_WRITTEN, micros() - writeStart);
+
+  renderLEDs();
+
+  reply("OK");
+  return true;
+}
+
+// A segment must lie within the strip, for a mask up to its highest set bit
+bool validSegment(const segmentConfig &segment) {
+  if (segment.mask != 0) {
+    return segment.start + 31 - __builtin_clz(segment.mask) < PIXEL_COUNT;
+  }
+  return segment.start + (uint32_t)segment.count <= PIXEL_COUNT;
+}
+
+// Load the segment table, each indicator defaults to the pixel of its index
+void loadSegments() {
+  segmentEEPROM stored;
+  EEPROM.get(SEGMENT_EEPROM_ADDRESS, stored);
+
+  for (int i = 0; i < INDICATOR_COUNT; i++) {
+    if (stored.version == SEGMENT_EEPROM_VERSION && validSegment(stored.segments[i])) {
+      segments[i] = stored.segments[i];
+    } else {
+      segments[i].start = i < PIXEL_COUNT ? i : 0;
+      segments[i].count = i < PIXEL_COUNT ? 1 : 0;
+      segments[i].mask = 0;
+    }
+  }
+}
+
+// Convert screens stored before profiles existed, they get default profiles
+void migrateScreens() {
+  screenEEPROMv1 legacy;
+  EEPROM.get(SCREEN_EEPROM_ADDRESS, legacy);
+
+  memset(&EEPROMData, 0, sizeof(EEPROMData));
+  EEPROMData.eevar.version = SCREEN_EEPROM_VERSION;
+  EEPROMData.eevar.count = legacy.count > SCREEN_COUNT ? SCREEN_COUNT : legacy.count;
+  for (unsigned int i = 0; i < EEPROMData.eevar.count; i++) {
+    EEPROMData.eevar.screens[i].id = legacy.screens[i].id;
+    EEPROMData.eevar.screens[i].indicator = legacy.screens[i].indicator;
+  }
+}
+
+void updateScreens() {
+  // Copy the registry into the eeprom struct
+  const screenSnapshot *view = readScreens();
+  memcpy(EEPROMData.eevar.screens, view->screens, view->count * sizeof(screenConfig));
+  EEPROMData.eevar.version = SCREEN_EEPROM_VERSION;
+  EEPROMData.eevar.count = view->count;
+  releaseScreens(view);
+
+  writeEEPROM();
+}
+
+// Load the aliases and index them, starting empty when the stored arena does
+// not hold exactly `count` valid names
+void loadAliases() {
+  EEPROM.get(ALIAS_EEPROM_ADDRESS, aliases);
+
+  bool valid = aliases.version == ALIAS_EEPROM_VERSION &&
+    aliases.count <= ALIAS_COUNT && aliases.used <= ALIAS_ARENA_SIZE;
+  uint16_t offset = 0;
+  for (int i = 0; valid && i < aliases.count; i++) {
+    const char *name = aliases.arena + offset;
+    size_t length = strnlen(name, aliases.used - offset);
+    valid = offset + length < aliases.used && validAlias(name);
+    aliasOffset[i] = offset;
+    offset += length + 1;
+  }
+
+  if (!valid || offset != aliases.used) {
+    memset(&aliases, 0, sizeof(aliases));
+    aliases.version = ALIAS_EEPROM_VERSION;
+  }
+  indexAliases();
+}
+
+void saveAliases() {
+  aliases.version = ALIAS_EEPROM_VERSION;
+  unsigned long writeStart = micros();
+  EEPROM.put(ALIAS_EEPROM_ADDRESS, aliases);
+  trace(TRACE_EEPROM_WRITTEN, micros() - writeStart);
+}
+
+void readEEPROM(void) {
+  EEPROM.get(SCREEN_EEPROM_ADDRESS, EEPROMData.eevar);
+}
+
+void writeEEPROM(void) {
+  unsigned long writeStart = micros();
+  EEPROM.put(SCREEN_EEPROM_ADDRESS, EEPROMData.eevar);
+  trace(TRACE_EEPROM_WRITTEN, micros() - writeStart);
+}
+
+byte activeCheck(const activeRecord &record) {
+  uint32_t indicators = record.indicators;
+  return indicators ^ (indicators >> 8) ^ (indicators >> 16) ^ (indicators >> 24) ^
+    record.sequence ^ ACTIVE_RECORD_MAGIC;
+}
+
+// Find the newest slot in the ring, returns its indicators or 0 when none
+uint32_t loadActiveIndicators() {
+  const uint32_t allIndicators = INDICATOR_COUNT < 32 ? (1UL << INDICATOR_COUNT) - 1 : 0xFFFFFFFFUL;
+  activeRecord records[ACTIVE_RING_SLOTS];
+  bool valid[ACTIVE_RING_SLOTS];
+  for (int i = 0; i < ACTIVE_RING_SLOTS; i++) {
+    EEPROM.get(ACTIVE_EEPROM_ADDRESS + i * sizeof(activeRecord), records[i]);
+    valid[i] = records[i].check == activeCheck(records[i]) &&
+      (records[i].indicators & ~allIndicators) == 0;
+  }
+
+  activeSlot = -1;
+  savedIndicators = 0;
+  for (int i = 0; i < ACTIVE_RING_SLOTS; i++) {
+    int next = (i + 1) % ACTIVE_RING_SLOTS;
+    if (valid[i] && (!valid[next] || records[next].sequence != (byte)(records[i].sequence + 1))) {
+      activeSlot = i;
+      activeSequence = records[i].sequence;
+      savedIndicators = records[i].indicators;
+      break;
+    }
+  }
+
+  activeDirty = false;
+  return savedIndicators;
+}
+
+// Append the active indicators to the ring, skipping the write when unchanged
+void saveActiveIndicators(uint32_t indicators) {
+  activeDirty = false;
+  if (indicators == savedIndicators) return;
+
+  activeSlot = (activeSlot + 1) % ACTIVE_RING_SLOTS;
+  activeSequence++;
+  activeRecord record = { indicators, activeSequence, 0, 0 };
+  record.check = activeCheck(record);
+
+  unsigned long writeStart = micros();
+  EEPROM.put(ACTIVE_EEPROM_ADDRESS + activeSlot * sizeof(activeRecord), record);
+  trace(TRACE_EEPROM_WRITTEN, micros() - writeStart);
+  savedIndicators = indicators;
+}
+
+
+// =---------------------------------------------= Particle Cloud Functions =--=
+// These run on the system thread. They only queue the command for loop(),
+// returning 0 once queued and -1 when the queue is full; the result of the
+// command itself is reported on Serial like any other.
+int call_addScreen(String input) {
+  // input => screenId, indicator
+  return queueCloudCommand("add", input);
+}
+
+int call_removeScreen(String input) {
+  // input => screenId
+  return queueCloudCommand("remove", input);
+}
+
+// The `digest` cloud variable, read from a snapshot like any other reader
+// so it always matches one published registry
+String call_digest() {
+  char hex[17];
+  const screenSnapshot *view = readScreens();
+  snprintf(hex, sizeof(hex), "%08lx%08lx",
+    (unsigned long)(view->digest >> 32), (unsigned long)(uint32_t)view->digest);
+  releaseScreens(view);
+  return String(hex);
+}
+
+int queueCloudCommand(const char *command, const String &input) {
+  commandRecord *record = commandSlot(cloudQueue);
+  if (!record) {
+    cloudDropped++;
+    return -1;
+  }
+
+  snprintf(record->line, COMMAND_BUFFER_SIZE, "%s %s", command, input.c_str());
+  record->count = split(record->line, ' ', record->tokens, COMMAND_MAX_TOKENS);
+  record->startTime = micros();
+  pushCommand(cloudQueue);
+  return 0;
 }
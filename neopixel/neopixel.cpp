@@ -65,11 +65,83 @@
 // fast pin access
 #define pinSet(_pin, _hilo) (_hilo ? pinHI(_pin) : pinLO(_pin))
 
+// Bit timing for 800 KHz pixels clocked out against the DWT cycle counter.
+// Each profile gives the pulse widths in nanoseconds as they should appear on
+// the wire; the wait loops in show() are generated from them and the CPU clock
+// at compile time. Only platforms with the cycle counter use these.
+#if (PLATFORM_ID == 6) || (PLATFORM_ID == 8) || (PLATFORM_ID == 10) || (PLATFORM_ID == 88) // Photon (6), P1 (8), Electron (10) or Redbear Duo (88)
+  #define NEOPIXEL_DWT_TIMING 1
+  #define NEOPIXEL_CPU_HZ 120000000
+
+  // Cycles each phase spends outside its wait loop: pin writes, the bit test
+  // and fetching the next bit. Measured on a Photon.
+  #define DWT_OVERHEAD_T0H 11
+  #define DWT_OVERHEAD_T1H 16
+  #define DWT_OVERHEAD_LOW 43
+
+  // The host build has no instructions to take that time, so it is charged
+  // the overhead where each wait ends. Nothing on a device.
+  #ifndef CHARGE_DWT_OVERHEAD
+    #define CHARGE_DWT_OVERHEAD(cycles)
+  #endif
+
+  struct bitTiming {
+    uint16_t t0h, t0l, t1h, t1l; // Nanoseconds high then low for a 0 and a 1 bit
+  };
+
+  // WS2812B datasheet: 400/850ns for a 0, 800/450ns for a 1, each +-150ns
+  constexpr bitTiming WS2812B_MIN = { 250, 700, 650, 300 };
+  constexpr bitTiming WS2812B_MAX = { 550, 1000, 950, 600 };
+
+  // TIMING_DEFAULT keeps the widths this library has always sent, padded well
+  // inside the spec. TIMING_TIGHT sends the shortest the spec allows, cutting
+  // the time interrupts are off per pixel by about a fifth.
+  constexpr bitTiming TIMING_800[] = {
+    { 300, 940, 792, 425 }, // TIMING_DEFAULT
+    WS2812B_MIN             // TIMING_TIGHT
+  };
+
+  constexpr uint32_t nsToCycles(uint32_t ns) {
+    return ((uint64_t)ns * NEOPIXEL_CPU_HZ + 999999999) / 1000000000;
+  }
+  constexpr uint32_t cyclesToNs(uint32_t cycles) {
+    return (uint64_t)cycles * 1000000000 / NEOPIXEL_CPU_HZ;
+  }
+  // Cycles to wait so the phase lasts at least 'ns' on the wire
+  constexpr uint32_t waitCycles(uint32_t ns, uint32_t overhead) {
+    return nsToCycles(ns) > overhead ? nsToCycles(ns) - overhead : 0;
+  }
+  // Width the phase comes out at on the wire
+  constexpr uint32_t wireNs(uint32_t ns, uint32_t overhead) {
+    return cyclesToNs(waitCycles(ns, overhead) + overhead);
+  }
+  constexpr bool withinSpec(const bitTiming &t) {
+    return wireNs(t.t0h, DWT_OVERHEAD_T0H) >= WS2812B_MIN.t0h && wireNs(t.t0h, DWT_OVERHEAD_T0H) <= WS2812B_MAX.t0h &&
+           wireNs(t.t0l, DWT_OVERHEAD_LOW) >= WS2812B_MIN.t0l && wireNs(t.t0l, DWT_OVERHEAD_LOW) <= WS2812B_MAX.t0l &&
+           wireNs(t.t1h, DWT_OVERHEAD_T1H) >= WS2812B_MIN.t1h && wireNs(t.t1h, DWT_OVERHEAD_T1H) <= WS2812B_MAX.t1h &&
+           wireNs(t.t1l, DWT_OVERHEAD_LOW) >= WS2812B_MIN.t1l && wireNs(t.t1l, DWT_OVERHEAD_LOW) <= WS2812B_MAX.t1l;
+  }
+
+  // Golden values: the default profile generates the hand-tuned waits it
+  // replaced, and every profile stays within the datasheet
+  static_assert(waitCycles(TIMING_800[TIMING_DEFAULT].t0h, DWT_OVERHEAD_T0H) == 25 &&
+                waitCycles(TIMING_800[TIMING_DEFAULT].t0l, DWT_OVERHEAD_LOW) == 70 &&
+                waitCycles(TIMING_800[TIMING_DEFAULT].t1h, DWT_OVERHEAD_T1H) == 80 &&
+                waitCycles(TIMING_800[TIMING_DEFAULT].t1l, DWT_OVERHEAD_LOW) == 8,
+                "default timing changed");
+  static_assert(withinSpec(TIMING_800[TIMING_DEFAULT]), "default timing outside WS2812B spec");
+  static_assert(withinSpec(TIMING_800[TIMING_TIGHT]), "tight timing outside WS2812B spec");
+#else
+  #define NEOPIXEL_DWT_TIMING 0
+#endif
+
 Adafruit_NeoPixel::Adafruit_NeoPixel(uint16_t n, uint8_t p, uint8_t t) :
-  begun(false), type(t), brightness(0), pixels(NULL), endTime(0)
+  begun(false), powerBudget(0), type(t), timing(TIMING_DEFAULT), brightness(0), pixels(NULL),
+  powerChannel(20), powerIdle(1), powerScale(0), endTime(0), showTime(0), levelSum(0)
 {
   updateLength(n);
   setPin(p);
+  updatePowerScale(); // Builds the pass-through LUT
 }
 
 Adafruit_NeoPixel::~Adafruit_NeoPixel() {
@@ -88,6 +160,7 @@ void Adafruit_NeoPixel::updateLength(uint16_t n) {
   } else {
     numLEDs = numBytes = 0;
   }
+  levelSum = 0;
 }
 
 void Adafruit_NeoPixel::begin(void) {
@@ -113,6 +186,8 @@ void Adafruit_NeoPixel::setPin(uint8_t p) {
 void Adafruit_NeoPixel::show(void) {
   if(!pixels) return;
 
+  updatePowerScale(); // Before the latch wait, it may rebuild the LUT
+
   // Data latch = 24 or 50 microsecond pause in the output stream.  Rather than
   // put a delay at the end of the function, the ending time is noted and
   // the function will simply hold off (if needed) on issuing the
@@ -142,6 +217,7 @@ void Adafruit_NeoPixel::show(void) {
   // instances on different pins can be quickly issued in succession (each
   // instance doesn't delay the next).
 
+  uint32_t startTime = micros(); // Wire time excludes the latch wait above
   __disable_irq(); // Need 100% focus on instruction timing
 
   volatile uint32_t
@@ -151,18 +227,24 @@ void Adafruit_NeoPixel::show(void) {
   volatile uint8_t
     j,              // 8-bit inner loop counter
    *ptr = pixels,   // Pointer to next byte
+   *lut = powerLUT, // Output value per byte, scaled down to the power budget
     g,              // Current green byte value
     r,              // Current red byte value
     b,              // Current blue byte value
     w;              // Current white byte value
 
-  if(type == WS2812B) { // same as WS2812, 800 KHz bitstream
+  // The tight profile needs the cycle counter, so it moves WS2812B onto the
+  // DWT timed loop. Without one WS2812B keeps its nop timed loop.
+  bool dwtTimed = NEOPIXEL_DWT_TIMING &&
+    (type == WS2812B2 || (type == WS2812B && timing == TIMING_TIGHT));
+
+  if(type == WS2812B && !dwtTimed) { // same as WS2812, 800 KHz bitstream
     while(i) { // While bytes left... (3 bytes = 1 pixel)
       mask = 0x800000; // reset the mask
       i = i-3;      // decrement bytes remaining
-      g = *ptr++;   // Next green byte value
-      r = *ptr++;   // Next red byte value
-      b = *ptr++;   // Next blue byte value
+      g = lut[*ptr++];   // Next green byte value
+      r = lut[*ptr++];   // Next red byte value
+      b = lut[*ptr++];   // Next blue byte value
       c = ((uint32_t)g << 16) | ((uint32_t)r <<  8) | b; // Pack the next 3 bytes to keep timing tight
       j = 0;        // reset the 24-bit counter
       do {
@@ -259,10 +341,10 @@ void Adafruit_NeoPixel::show(void) {
     while(i) { // While bytes left... (4 bytes = 1 pixel)
       mask = 0x80000000; // reset the mask
       i = i-4;      // decrement bytes remaining
-      r = *ptr++;   // Next red byte value
-      g = *ptr++;   // Next green byte value
-      b = *ptr++;   // Next blue byte value
-      w = *ptr++;   // Next white byte value
+      r = lut[*ptr++];   // Next red byte value
+      g = lut[*ptr++];   // Next green byte value
+      b = lut[*ptr++];   // Next blue byte value
+      w = lut[*ptr++];   // Next white byte value
       c = ((uint32_t)r << 24) | ((uint32_t)g << 16) | ((uint32_t)b <<  8) | w; // Pack the next 4 bytes to keep timing tight
       j = 0;        // reset the 32-bit counter
       do {
@@ -358,37 +440,48 @@ void Adafruit_NeoPixel::show(void) {
       } while ( ++j < 32 ); // ... pixel done
     } // end while(i) ... no more pixels
   }
-  else if(type == WS2812B2) { // WS2812B with DWT timer
-#if (PLATFORM_ID == 6) || (PLATFORM_ID == 8) || (PLATFORM_ID == 10) || (PLATFORM_ID == 88) // Photon (6), P1 (8), Electron (10) or Redbear Duo (88)
-    #define CYCLES_800_T0H  25 // 312ns (meas. 300ns)
-    #define CYCLES_800_T0L  70 // 938ns (meas. 940ns)
-    #define CYCLES_800_T1H  80 // 812ns (meas. 792ns)
-    #define CYCLES_800_T1L  8  // 436ns (meas. 425ns)
+  else if(dwtTimed) { // WS2812B with DWT timer
+#if NEOPIXEL_DWT_TIMING
+    // Waits for the chosen profile, both generated at compile time
+    const bool tight = timing == TIMING_TIGHT;
+    const uint32_t
+      t0h = tight ? waitCycles(TIMING_800[TIMING_TIGHT].t0h, DWT_OVERHEAD_T0H)
+                  : waitCycles(TIMING_800[TIMING_DEFAULT].t0h, DWT_OVERHEAD_T0H),
+      t0l = tight ? waitCycles(TIMING_800[TIMING_TIGHT].t0l, DWT_OVERHEAD_LOW)
+                  : waitCycles(TIMING_800[TIMING_DEFAULT].t0l, DWT_OVERHEAD_LOW),
+      t1h = tight ? waitCycles(TIMING_800[TIMING_TIGHT].t1h, DWT_OVERHEAD_T1H)
+                  : waitCycles(TIMING_800[TIMING_DEFAULT].t1h, DWT_OVERHEAD_T1H),
+      t1l = tight ? waitCycles(TIMING_800[TIMING_TIGHT].t1l, DWT_OVERHEAD_LOW)
+                  : waitCycles(TIMING_800[TIMING_DEFAULT].t1l, DWT_OVERHEAD_LOW);
 
     volatile uint32_t cyc;
 
     while(i) { // While bytes left... (3 bytes = 1 pixel)
       mask = 0x800000; // reset the mask
       i = i-3;      // decrement bytes remaining
-      g = *ptr++;   // Next green byte value
-      r = *ptr++;   // Next red byte value
-      b = *ptr++;   // Next blue byte value
+      g = lut[*ptr++];   // Next green byte value
+      r = lut[*ptr++];   // Next red byte value
+      b = lut[*ptr++];   // Next blue byte value
       c = ((uint32_t)g << 16) | ((uint32_t)r <<  8) | b; // Pack the next 3 bytes to keep timing tight
       j = 0;        // reset the 24-bit counter
       do {
         cyc = DWT->CYCCNT;
         pinSet(pin, HIGH); // HIGH
         if (c & mask) { // if masked bit is high
-          while(DWT->CYCCNT - cyc < CYCLES_800_T1H);
+          while(DWT->CYCCNT - cyc < t1h);
+          CHARGE_DWT_OVERHEAD(DWT_OVERHEAD_T1H);
           pinSet(pin, LOW);
           cyc = DWT->CYCCNT;
-          while(DWT->CYCCNT - cyc < CYCLES_800_T1L);
+          while(DWT->CYCCNT - cyc < t1l);
+          CHARGE_DWT_OVERHEAD(DWT_OVERHEAD_LOW);
         }
         else { // else masked bit is low
-          while(DWT->CYCCNT - cyc < CYCLES_800_T0H);
+          while(DWT->CYCCNT - cyc < t0h);
+          CHARGE_DWT_OVERHEAD(DWT_OVERHEAD_T0H);
           pinSet(pin, LOW);
           cyc = DWT->CYCCNT;
-          while(DWT->CYCCNT - cyc < CYCLES_800_T0L);
+          while(DWT->CYCCNT - cyc < t0l);
+          CHARGE_DWT_OVERHEAD(DWT_OVERHEAD_LOW);
         }
         mask >>= 1;
       } while ( ++j < 24 ); // ... pixel done
@@ -399,9 +492,9 @@ void Adafruit_NeoPixel::show(void) {
     while(i) { // While bytes left... (3 bytes = 1 pixel)
       mask = 0x800000; // reset the mask
       i = i-3;      // decrement bytes remaining
-      r = *ptr++;   // Next red byte value
-      g = *ptr++;   // Next green byte value
-      b = *ptr++;   // Next blue byte value
+      r = lut[*ptr++];   // Next red byte value
+      g = lut[*ptr++];   // Next green byte value
+      b = lut[*ptr++];   // Next blue byte value
       c = ((uint32_t)r << 16) | ((uint32_t)g <<  8) | b; // Pack the next 3 bytes to keep timing tight
       j = 0;        // reset the 24-bit counter
       do {
@@ -557,9 +650,9 @@ void Adafruit_NeoPixel::show(void) {
     while(i) { // While bytes left... (3 bytes = 1 pixel)
       mask = 0x800000; // reset the mask
       i = i-3;      // decrement bytes remaining
-      r = *ptr++;   // Next red byte value
-      g = *ptr++;   // Next blue byte value
-      b = *ptr++;   // Next green byte value
+      r = lut[*ptr++];   // Next red byte value
+      g = lut[*ptr++];   // Next blue byte value
+      b = lut[*ptr++];   // Next green byte value
       c = ((uint32_t)r << 16) | ((uint32_t)g <<  8) | b; // Pack the next 3 bytes to keep timing tight
       j = 0;        // reset the 24-bit counter
       do {
@@ -694,9 +787,9 @@ void Adafruit_NeoPixel::show(void) {
     while(i) { // While bytes left... (3 bytes = 1 pixel)
       mask = 0x800000; // reset the mask
       i = i-3;      // decrement bytes remaining
-      r = *ptr++;   // Next red byte value
-      b = *ptr++;   // Next blue byte value
-      g = *ptr++;   // Next green byte value
+      r = lut[*ptr++];   // Next red byte value
+      b = lut[*ptr++];   // Next blue byte value
+      g = lut[*ptr++];   // Next green byte value
       c = ((uint32_t)r << 16) | ((uint32_t)b <<  8) | g; // Pack the next 3 bytes to keep timing tight
       j = 0;        // reset the 24-bit counter
       pinSet(pin, LOW); // LOW
@@ -787,6 +880,7 @@ void Adafruit_NeoPixel::show(void) {
 
   __enable_irq();
   endTime = micros(); // Save EOD time for latch on next call
+  showTime = endTime - startTime;
 }
 
 // Set pixel color from separate R,G,B components:
@@ -798,7 +892,8 @@ void Adafruit_NeoPixel::setPixelColor(
       g = (g * brightness) >> 8;
       b = (b * brightness) >> 8;
     }
-    uint8_t *p = &pixels[n * 3];
+    uint8_t *pixel = &pixels[n * 3], *p = pixel;
+    levelSum -= pixelLevel(pixel);
     switch(type) {
       case WS2812B: // WS2812 & WS2812B is GRB order.
       case WS2812B2:
@@ -820,6 +915,7 @@ void Adafruit_NeoPixel::setPixelColor(
         *p = b;
         break;
     }
+    levelSum += pixelLevel(pixel);
   }
 }
 
@@ -833,7 +929,8 @@ void Adafruit_NeoPixel::setPixelColor(
       b = (b * brightness) >> 8;
       w = (w * brightness) >> 8;
     }
-    uint8_t *p = &pixels[n * (type==SK6812RGBW?4:3)];
+    uint8_t *pixel = &pixels[n * (type==SK6812RGBW?4:3)], *p = pixel;
+    levelSum -= pixelLevel(pixel);
     switch(type) {
       case WS2812B: // WS2812 & WS2812B is GRB order.
       case WS2812B2:
@@ -861,6 +958,7 @@ void Adafruit_NeoPixel::setPixelColor(
         *p = b;
         break;
     }
+    levelSum += pixelLevel(pixel);
   }
 }
 
@@ -877,7 +975,8 @@ void Adafruit_NeoPixel::setPixelColor(uint16_t n, uint32_t c) {
       g = (g * brightness) >> 8;
       b = (b * brightness) >> 8;
     }
-    uint8_t *p = &pixels[n * (type==SK6812RGBW?4:3)];
+    uint8_t *pixel = &pixels[n * (type==SK6812RGBW?4:3)], *p = pixel;
+    levelSum -= pixelLevel(pixel);
     switch(type) {
       case WS2812B: // WS2812 & WS2812B is GRB order.
       case WS2812B2: {
@@ -910,6 +1009,30 @@ void Adafruit_NeoPixel::setPixelColor(uint16_t n, uint32_t c) {
         }
         break;
     }
+    levelSum += pixelLevel(pixel);
+  }
+}
+
+// Fill 'count' pixels starting at 'first' with a packed color, or to the
+// end of the strip when count is 0. The first pixel is set normally, so
+// brightness and color order apply, then its bytes are replicated with
+// doubling memcpy calls rather than per-pixel setPixelColor.
+void Adafruit_NeoPixel::fill(uint32_t c, uint16_t first, uint16_t count) {
+  if(first >= numLEDs) return;
+  if(count == 0 || count > numLEDs - first) count = numLEDs - first;
+
+  setPixelColor(first, c);
+
+  uint8_t bytesPerPixel = (type == SK6812RGBW) ? 4 : 3;
+  uint8_t *start = &pixels[first * bytesPerPixel];
+  size_t filled = bytesPerPixel;
+  size_t total = (size_t)count * bytesPerPixel;
+  for(size_t k = filled; k < total; k++) levelSum -= start[k];
+  levelSum += (uint32_t)(count - 1) * pixelLevel(start);
+  while(filled < total) {
+    size_t chunk = (filled < total - filled) ? filled : total - filled;
+    memcpy(start + filled, start, chunk);
+    filled += chunk;
   }
 }
 
@@ -977,7 +1100,7 @@ uint32_t Adafruit_NeoPixel::getPixelColor(uint16_t n) const {
       }
       break;
     case SK6812RGBW: { // SK6812RGBW is RGBW order, but returns packed WRGB color
-        c = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] <<  8) | (uint32_t)p[3];
+        c = ((uint32_t)p[3] << 24) | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] <<  8) | (uint32_t)p[2];
       }
       break;
     case WS2811: // WS2811 is RGB order
@@ -1003,6 +1126,18 @@ uint32_t Adafruit_NeoPixel::getPixelColor(uint16_t n) const {
   return c; // Pixel # is out of bounds
 }
 
+// Pick the bit timing profile, TIMING_DEFAULT or TIMING_TIGHT. The tight
+// profile applies to WS2812B and WS2812B2 on platforms with a cycle counter.
+void Adafruit_NeoPixel::setTiming(uint8_t t) {
+  timing = t;
+}
+
+// Microseconds the last show() spent clocking out data with interrupts
+// disabled, not counting the latch hold off before it.
+uint32_t Adafruit_NeoPixel::getShowTime(void) const {
+  return showTime;
+}
+
 uint8_t *Adafruit_NeoPixel::getPixels(void) const {
   return pixels;
 }
@@ -1044,9 +1179,11 @@ void Adafruit_NeoPixel::setBrightness(uint8_t b) {
     if(oldBrightness == 0) scale = 0; // Avoid /0
     else if(b == 255) scale = 65535 / oldBrightness;
     else scale = (((uint16_t)newBrightness << 8) - 1) / oldBrightness;
+    levelSum = 0;
     for(uint16_t i=0; i<numBytes; i++) {
       c      = *ptr;
       *ptr++ = (c * scale) >> 8;
+      levelSum += (c * scale) >> 8;
     }
     brightness = newBrightness;
   }
@@ -1059,4 +1196,69 @@ uint8_t Adafruit_NeoPixel::getBrightness(void) const {
 
 void Adafruit_NeoPixel::clear(void) {
   memset(pixels, 0, numBytes);
+  levelSum = 0;
+}
+
+// Replace the whole strip with a frame rendered earlier. 'level' is what
+// getLevelSum() returned for that frame, so nothing has to be recounted.
+void Adafruit_NeoPixel::setPixels(const uint8_t *data, uint32_t level) {
+  memcpy(pixels, data, numBytes);
+  levelSum = level;
+}
+
+// For callers that write getPixels() themselves: the sum of the bytes now
+// in the buffer, so the power estimate stays right without a rescan
+void Adafruit_NeoPixel::setLevelSum(uint32_t level) {
+  levelSum = level;
+}
+
+// Sum of every byte in the pixel buffer, the strip's drive level
+uint32_t Adafruit_NeoPixel::getLevelSum(void) const {
+  return levelSum;
+}
+
+// Limit the current the strip may draw. Each channel draws up to
+// 'channelMilliamps' at full level and each pixel 'idleMilliamps' when dark.
+// When show() finds the estimate over the budget it sends every byte scaled
+// down by one common factor; the pixel buffer itself is left as it is.
+// A budget of 0 removes the limit.
+void Adafruit_NeoPixel::setPowerBudget(
+  uint16_t milliamps, uint8_t channelMilliamps, uint8_t idleMilliamps) {
+  powerBudget  = milliamps;
+  powerChannel = channelMilliamps;
+  powerIdle    = idleMilliamps;
+}
+
+// Milliamps the strip would draw showing the buffer unscaled
+uint32_t Adafruit_NeoPixel::getPowerEstimate(void) const {
+  return (uint32_t)(((uint64_t)levelSum * powerChannel + 254) / 255) +
+    (uint32_t)numLEDs * powerIdle;
+}
+
+// Scale the last show() applied to fit the budget, 255 when none was needed
+uint8_t Adafruit_NeoPixel::getPowerScale(void) const {
+  return powerScale;
+}
+
+// Pick the scale that brings the estimate within budget. The running level
+// sum makes this O(1); the LUT is only rebuilt when the scale changes.
+void Adafruit_NeoPixel::updatePowerScale(void) {
+  uint8_t scale = 255;
+  if(powerBudget) {
+    uint32_t idle  = (uint32_t)numLEDs * powerIdle;
+    uint32_t drive = getPowerEstimate() - idle;
+    if(idle + drive > powerBudget) {
+      scale = (powerBudget > idle) ? (uint64_t)(powerBudget - idle) * 255 / drive : 0;
+    }
+  }
+  if(scale != powerScale) {
+    for(uint16_t v=0; v<256; v++) powerLUT[v] = (v * (scale + 1)) >> 8;
+    powerScale = scale;
+  }
+}
+
+uint16_t Adafruit_NeoPixel::pixelLevel(const uint8_t *p) const {
+  uint16_t level = p[0] + p[1] + p[2];
+  if(type == SK6812RGBW) level += p[3];
+  return level;
 }
@@ -64,6 +64,10 @@
 #define WS2812B2 0x05 // 800 KHz datastream (NeoPixel)
 #define SK6812RGBW 0x06 // 800 KHz datastream (NeoPixel RGBW)
 
+// Bit timing profiles for setTiming():
+#define TIMING_DEFAULT 0 // Widths padded well inside the spec
+#define TIMING_TIGHT   1 // Shortest widths the spec allows, less time with interrupts off
+
 class Adafruit_NeoPixel {
 
  public:
@@ -79,18 +83,24 @@ class Adafruit_NeoPixel {
     setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b),
     setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b, uint8_t w),
     setPixelColor(uint16_t n, uint32_t c),
+    fill(uint32_t c=0, uint16_t first=0, uint16_t count=0),
     setBrightness(uint8_t),
+    setTiming(uint8_t t),
     setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue),
     setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aWhite),
     setColorScaled(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aScaling),
     setColorScaled(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aWhite, byte aScaling),
     setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aBrightness),
     setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aWhite, byte aBrightness),
+    setPixels(const uint8_t *data, uint32_t level),
+    setLevelSum(uint32_t level),
+    setPowerBudget(uint16_t milliamps, uint8_t channelMilliamps=20, uint8_t idleMilliamps=1),
     updateLength(uint16_t n),
     clear(void);
   uint8_t
    *getPixels() const,
-    getBrightness(void) const;
+    getBrightness(void) const,
+    getPowerScale(void) const;
   uint16_t
     numPixels(void) const,
     getNumLeds(void) const;
@@ -98,25 +108,41 @@ class Adafruit_NeoPixel {
     Color(uint8_t r, uint8_t g, uint8_t b),
     Color(uint8_t r, uint8_t g, uint8_t b, uint8_t w);
   uint32_t
-    getPixelColor(uint16_t n) const;
+    getPixelColor(uint16_t n) const,
+    getShowTime(void) const,
+    getLevelSum(void) const,
+    getPowerEstimate(void) const;
   byte
     brightnessToPWM(byte aBrightness);
 
  private:
 
+  void
+    updatePowerScale(void);
+  uint16_t
+    pixelLevel(const uint8_t *p) const;
+
   bool
     begun;         // true if begin() previously called
   uint16_t
     numLEDs,       // Number of RGB LEDs in strip
-    numBytes;      // Size of 'pixels' buffer below
+    numBytes,      // Size of 'pixels' buffer below
+    powerBudget;   // Milliamps the strip may draw, 0 for no limit
   const uint8_t
     type;          // Pixel type flag (400 vs 800 KHz)
   uint8_t
+    timing,        // Bit timing profile, TIMING_DEFAULT or TIMING_TIGHT
     pin,           // Output pin number
     brightness,
-   *pixels;        // Holds LED color values (3 bytes each)
+   *pixels,        // Holds LED color values (3 bytes each)
+    powerChannel,  // Milliamps one channel draws at full level
+    powerIdle,     // Milliamps one pixel draws when dark
+    powerScale,    // Scale powerLUT was built for, 255 passes bytes through
+    powerLUT[256]; // Output value for each byte in 'pixels', applied by show()
   uint32_t
-    endTime;       // Latch timing reference
+    endTime,       // Latch timing reference
+    showTime,      // Microseconds the last bitstream spent on the wire
+    levelSum;      // Sum of every byte in 'pixels', kept up to date by the setters
 };
 
 #endif // ADAFRUIT_NEOPIXEL_H